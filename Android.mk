@@ -4,18 +4,81 @@ ifneq ($(TARGET_SIMULATOR),true)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES:= \
+		pixel.c \
 		framebuffer.c \
 		gifdecode.c \
+		framecache.c \
+		scale.c \
+		gauge.c \
+		uevent.c \
 		device.c \
+		event.c \
+		fade.c \
+		led.c \
 		input.c \
+		stats.c \
+		trace.c \
 		charge.c
  
 LOCAL_MODULE := charge
-LOCAL_CFLAGS := -DCHARGE_ENABLE_SCREEN
-LOCAL_C_INCLUDES += external/giflib
-LOCAL_STATIC_LIBRARIES += libcutils libgif
+LOCAL_CFLAGS := -DCHARGE_ENABLE_SCREEN -DCHARGE_INDEXED_FRAMES
+# the gauge replaces the animation with two layers, boards opt in
+ifeq ($(CHARGE_USE_GAUGE),true)
+LOCAL_CFLAGS += -DCHARGE_GAUGE
+endif
+LOCAL_STATIC_LIBRARIES += libcutils
 include $(BUILD_EXECUTABLE)
 
+# decode and render benchmark against a framebuffer in memory
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= \
+		pixel.c \
+		framebuffer.c \
+		gifdecode.c \
+		scale.c \
+		bench.c
+
+LOCAL_MODULE := charge_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_LDLIBS := -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+# charge itself on the host, driven by charge_sim through -r/-f/-u/-i
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= \
+		pixel.c \
+		framebuffer.c \
+		gifdecode.c \
+		framecache.c \
+		scale.c \
+		gauge.c \
+		uevent.c \
+		device.c \
+		event.c \
+		fade.c \
+		led.c \
+		input.c \
+		stats.c \
+		trace.c \
+		charge.c
+
+LOCAL_MODULE := charge_host
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS := -DCHARGE_ENABLE_SCREEN -DCHARGE_INDEXED_FRAMES
+ifeq ($(CHARGE_USE_GAUGE),true)
+LOCAL_CFLAGS += -DCHARGE_GAUGE
+endif
+LOCAL_STATIC_LIBRARIES += libcutils liblog
+LOCAL_LDLIBS := -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+# replays a scripted charge session against a simulated device
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= sim.c
+LOCAL_MODULE := charge_sim
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(CLEAR_VARS)
 file := $(TARGET_OUT)/usr/share/charge/battery.gif
 ALL_PREBUILT += $(file)
@@ -0,0 +1,349 @@
+/* host benchmark of the decode and render paths against a framebuffer in
+ * memory, results are printed as json on stdout:
+ *
+ *   charge_bench [-s WxH] [-n iterations] [file.gif ...]
+ */
+
+#include "framebuffer.h"
+#include "gifdecode.h"
+#include "scale.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_GIF   "data/battery.gif"
+#define BENCH_ITERATIONS    20
+
+typedef struct _BenchFormat BenchFormat;
+
+struct _BenchFormat
+{
+    const char *name;
+    int         bpp;
+    int         red, green, blue;   /* offsets, lengths follow from bpp */
+};
+
+static const BenchFormat bench_formats[] =
+{
+    { "rgb565",   16, 11, 5, 0 },
+    { "rgb888",   24, 16, 8, 0 },
+    { "xrgb8888", 32, 16, 8, 0 },
+    { "xbgr8888", 32, 0, 8, 16 },
+};
+
+static const char *bench_kernels[] = { "c", "avx2", "neon" };
+
+static FILE *out;
+static int bench_width = 480, bench_height = 800;
+static int bench_iterations = BENCH_ITERATIONS;
+
+static double now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* peak rss since the last reset, in kB */
+static long peak_rss()
+{
+    char line[128];
+    long kb = -1;
+    FILE *fp = fopen("/proc/self/status", "r");
+
+    if (fp == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+            break;
+    }
+
+    fclose(fp);
+
+    return kb;
+}
+
+static void reset_peak_rss()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+
+    if (fd >= 0)
+    {
+        write(fd, "5", 1);
+        close(fd);
+    }
+}
+
+static void init_mode(struct fb_var_screeninfo *vinfo, const BenchFormat *format)
+{
+    int len = format->bpp == 16 ? 5 : 8;
+
+    memset(vinfo, 0, sizeof(*vinfo));
+    vinfo->xres = bench_width;
+    vinfo->yres = bench_height;
+    vinfo->bits_per_pixel = format->bpp;
+    vinfo->red.offset = format->red;
+    vinfo->red.length = len;
+    vinfo->green.offset = format->green;
+    vinfo->green.length = format->bpp == 16 ? 6 : 8;
+    vinfo->blue.offset = format->blue;
+    vinfo->blue.length = len;
+}
+
+/* decode the way charge does: scan, scale to the screen, all frames resident */
+static GifImages *bench_load(const char *fname, int mode, FBSurface *surf,
+                             double *scan_ms, double *decode_ms)
+{
+    GifImages *imgs;
+    double start = now_ms();
+    int i;
+
+    imgs = gif_decode(fname, mode, &surf->format);
+    *scan_ms = now_ms() - start;
+
+    if (imgs == NULL)
+        return NULL;
+
+    if (!((imgs->w == surf->width && imgs->h <= surf->height) ||
+          (imgs->h == surf->height && imgs->w <= surf->width)))
+    {
+        GifImages *scaled = scale_images(imgs, surf->width, surf->height,
+                                         SCALE_BILINEAR, &surf->format);
+
+        if (scaled == NULL)
+        {
+            gif_free(imgs);
+            return NULL;
+        }
+
+        imgs = scaled;
+    }
+
+    gif_set_ring(imgs, 0);
+
+    for (i = 0; i < imgs->count; i++)
+    {
+        if (gif_get_frame(imgs, i) == NULL)
+        {
+            gif_free(imgs);
+            return NULL;
+        }
+    }
+
+    *decode_ms = now_ms() - start;
+
+    return imgs;
+}
+
+/* lut expansion of whole frames into plain memory, per kernel */
+static void bench_expand(GifImages *imgs, FBSurface *surf)
+{
+    char *dst = malloc((size_t)imgs->w * imgs->h * surf->depth);
+    int i, k, n, first = 1;
+
+    fprintf(out, ", \"expand_mpix_s\": {");
+
+    for (k = 0; k < (int)(sizeof(bench_kernels) / sizeof(bench_kernels[0])); k++)
+    {
+        double start;
+
+        if (pixel_set_kernel(bench_kernels[k]) < 0)
+            continue;
+
+        start = now_ms();
+
+        for (n = 0; n < bench_iterations; n++)
+        {
+            for (i = 0; i < imgs->count; i++)
+            {
+                pixel_get_expander(surf->depth)(dst, imgs->w * surf->depth,
+                        (const uint8_t *)gif_get_frame(imgs, i), imgs->w,
+                        imgs->w, imgs->h, gif_get_lut(imgs, i));
+            }
+        }
+
+        fprintf(out, "%s\"%s\": %.1f", first ? "" : ", ", bench_kernels[k],
+                (double)imgs->w * imgs->h * imgs->count * bench_iterations /
+                ((now_ms() - start) * 1e3));
+        first = 0;
+    }
+
+    fprintf(out, "}");
+    pixel_set_kernel(NULL);
+    free(dst);
+}
+
+static void bench_blit(FBSurface *surf, GifImages *imgs, int frame, int x, int y,
+                       const GifRect *rect)
+{
+    int pitch = imgs->w * imgs->depth;
+    const char *src = gif_get_frame(imgs, frame) + rect->y * pitch + rect->x * imgs->depth;
+
+    if (imgs->mode == GIF_MODE_INDEXED)
+    {
+        frame_buffer_blit_lut(surf, x + rect->x, y + rect->y, rect->w, rect->h,
+                              (const uint8_t *)src, pitch, gif_get_lut(imgs, frame));
+    }
+    else
+    {
+        frame_buffer_blit(surf, x + rect->x, y + rect->y, rect->w, rect->h, src, pitch);
+    }
+}
+
+static void bench_case(const char *fname, const BenchFormat *format, int mode, int *first)
+{
+    struct fb_var_screeninfo vinfo;
+    double scan_ms = 0, decode_ms = 0, start, elapsed;
+    int shown[FB_PAGES_MAX];
+    GifImages *imgs;
+    FBSurface *surf;
+    GifRect full;
+    uint64_t written;
+    int x, y, i, n;
+
+    reset_peak_rss();
+    init_mode(&vinfo, format);
+
+    surf = frame_buffer_get_memory(&vinfo);
+
+    if (surf == NULL)
+        return;
+
+    imgs = bench_load(fname, mode, surf, &scan_ms, &decode_ms);
+
+    if (imgs == NULL)
+    {
+        frame_buffer_close();
+        return;
+    }
+
+    x = (surf->width - imgs->w) / 2;
+    y = (surf->height - imgs->h) / 2;
+
+    fprintf(out, "%s", *first ? "" : ",\n");
+    *first = 0;
+
+    /* indexed decodes fall back to direct color when the palettes clash,
+     * the numbers are of the frames actually decoded */
+    fprintf(out, "    {\"gif\": \"%s\", \"format\": \"%s\", \"mode\": \"%s\", "
+            "\"requested\": \"%s\", \"frames\": %d, \"width\": %d, \"height\": %d, "
+            "\"scan_ms\": %.3f, \"decode_ms\": %.3f, \"decode_fps\": %.1f",
+            fname, format->name, imgs->mode == GIF_MODE_INDEXED ? "indexed" : "rgb",
+            mode == GIF_MODE_INDEXED ? "indexed" : "rgb",
+            imgs->count, imgs->w, imgs->h, scan_ms, decode_ms,
+            imgs->count * 1e3 / decode_ms);
+
+    if (imgs->mode == GIF_MODE_INDEXED)
+        bench_expand(imgs, surf);
+
+    /* whole frames into the framebuffer */
+    full.x = 0;
+    full.y = 0;
+    full.w = imgs->w;
+    full.h = imgs->h;
+    written = surf->written;
+    start = now_ms();
+
+    for (n = 0; n < bench_iterations; n++)
+    {
+        for (i = 0; i < imgs->count; i++)
+            bench_blit(surf, imgs, i, x, y, &full);
+    }
+
+    elapsed = now_ms() - start;
+
+    fprintf(out, ", \"blit_mb_s\": %.1f",
+            (surf->written - written) / (elapsed * 1e3));
+
+    /* the animation loop: delta against the page drawn two flips ago */
+    for (i = 0; i < FB_PAGES_MAX; i++)
+        shown[i] = -1;
+
+    written = surf->written;
+    start = now_ms();
+
+    for (n = 0; n < bench_iterations; n++)
+    {
+        for (i = 0; i < imgs->count; i++)
+        {
+            GifRect rect;
+
+            if (gif_get_delta(imgs, shown[surf->page], i, &rect))
+                bench_blit(surf, imgs, i, x, y, &rect);
+
+            shown[surf->page] = i;
+            frame_buffer_flip();
+        }
+    }
+
+    elapsed = now_ms() - start;
+    n = bench_iterations * imgs->count;
+
+    fprintf(out, ", \"frame_us\": %.2f, \"frame_bytes\": %llu, \"peak_rss_kb\": %ld}",
+            elapsed * 1e3 / n, (unsigned long long)(surf->written - written) / n, peak_rss());
+
+    gif_free(imgs);
+    frame_buffer_close();
+}
+
+int main(int argc, char *argv[])
+{
+    const char *fallback[] = { BENCH_DEFAULT_GIF };
+    const char **files;
+    int count, opt, i, k, first = 1;
+
+    while ((opt = getopt(argc, argv, "s:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                if (sscanf(optarg, "%dx%d", &bench_width, &bench_height) != 2)
+                    return 1;
+                break;
+
+            case 'n':
+                bench_iterations = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+
+            default:
+                fprintf(stderr, "usage: %s [-s WxH] [-n iterations] [file.gif ...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    files = optind < argc ? (const char **)argv + optind : fallback;
+    count = optind < argc ? argc - optind : 1;
+
+    /* the decoder reports progress on stdout, keep that for the results */
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    fprintf(out, "{\"screen\": \"%dx%d\", \"iterations\": %d, \"kernel\": \"%s\", \"results\": [\n",
+            bench_width, bench_height, bench_iterations, pixel_get_kernel_name());
+
+    for (i = 0; i < count; i++)
+    {
+        for (k = 0; k < (int)(sizeof(bench_formats) / sizeof(bench_formats[0])); k++)
+        {
+            int mode;
+
+            for (mode = GIF_MODE_RGB; mode <= GIF_MODE_INDEXED; mode++)
+            {
+                bench_case(files[i], &bench_formats[k], mode, &first);
+            }
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    return 0;
+}
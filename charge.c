@@ -3,21 +3,68 @@
 
 #include "framebuffer.h"
 #include "gifdecode.h"
+#include "framecache.h"
+#include "scale.h"
+#include "gauge.h"
 #include "device.h"
 #include "input.h"
+#include "event.h"
+#include "fade.h"
+#include "led.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <unistd.h>
-#include <signal.h>
+#include <time.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <sys/reboot.h>
 #include <cutils/log.h>
 
 #define CHARGE_ANIMATION    "/system/usr/share/charge/battery.gif"
+#define CHARGE_FRAME_CACHE  "/cache/charge/battery.frames"
+#define CHARGE_STATS_FILE   "/cache/charge/stats"      /* written on SIGUSR1 and at exit */
+#define CHARGE_TRACE_FILE   "/cache/charge/trace"      /* the same, without tracefs */
 #define CHARGE_WAKE_LOCK    "charge"
+#define CHARGE_CACHE_LOCK   "charge_cache"  /* held while the frame cache is written */
 #define CHARGE_WAKE_TIME    15
 #define CHARGE_LEVEL_MAX    4
+#define CHARGE_FADE_TIME    500
+#define CHARGE_FRAME_TIME   1000    /* for frames without a delay of their own */
+#define CHARGE_FRAME_WAIT   20      /* retry time for a frame still being decoded */
+#define CHARGE_TICK_TIME    1000    /* battery sampling and screen timeout */
+#define CHARGE_ALARM_MIN    60      /* seconds asleep between checks, at least */
+#define CHARGE_ALARM_MAX    1800    /* and at most, also the check once full */
+#define CHARGE_ALARM_DEFAULT 300    /* before the charge rate is known */
+
+#define CHARGE_RING_SIZE    (8 << 20)   /* bytes of decoded frames kept around */
+#define CHARGE_RING_PIN     8           /* animations this short keep every frame, */
+#define CHARGE_RING_PIN_SIZE (2 * CHARGE_RING_SIZE) /* if they fit in this many bytes */
+
+#ifndef CLOCK_BOOTTIME
+#define CLOCK_BOOTTIME          7
+#endif
+
+#ifndef CLOCK_BOOTTIME_ALARM
+#define CLOCK_BOOTTIME_ALARM    9
+#endif
+
+/* palette indices can not be blended, indexed builds scale nearest; the
+ * filter is part of the cache key, so it is the one actually used */
+#ifdef CHARGE_INDEXED_FRAMES
+#define CHARGE_FRAME_MODE   GIF_MODE_INDEXED
+#define CHARGE_SCALE_FILTER SCALE_NEAREST
+#else
+#define CHARGE_FRAME_MODE   GIF_MODE_RGB
+#define CHARGE_SCALE_FILTER SCALE_BILINEAR
+#endif
 
 typedef struct _ChargeContext ChargeContext;
 
@@ -25,165 +72,962 @@ struct _ChargeContext
 {
     FBSurface  *surface;
     GifImages  *images;
+    Gauge       gauge;
+    int         gauge_ready;            /* drawn from layers, images is NULL */
     int         lcd_bright;
     int         max_level;
+    int         x, y;                   /* animation origin, centered on screen */
+    int         visible;                /* frame or gauge percent on screen, -1 forces a full repaint */
+    int         shown[FB_PAGES_MAX];    /* the same held by each framebuffer page */
+    int         hotplug;                /* uevent socket, -1 when sysfs is polled */
+    int         frame_timer;
+    int         tick_timer;             /* runs only while the screen is on */
+    int         alarm_timer;            /* wakes the suspended device for a check */
+    int         alarm_rtc;              /* no alarm clock, the rtc does the waking */
+    struct timespec deadline;           /* when the frame on screen is due to change */
+    int         awake;                  /* wake window open, screen on */
+    int         dimming;                /* fading out at the end of the window */
+    int         ticks;                  /* into the wake window */
+    int         last_capacity;          /* -1 before the first sample */
+    int64_t     last_change;            /* boot clock ms of its change */
+    int64_t     percent_time;           /* ms per percent while charging, 0 unknown */
+    int         full;
+    int         cache_pending;          /* frames decoded, not stored in the cache yet */
+    int         cache_storing;          /* the store thread runs */
+    int         cache_owns;             /* and decodes into the ring, the animation waits */
+    int         cache_event;            /* eventfd the store thread signals when done */
+    pthread_t   cache_thread;
+    FrameCacheKey cache_key;
+    BatteryState battery;
+    char        animation[PATH_MAX];
+    char        frame_cache[PATH_MAX];
+    char        stats_file[PATH_MAX];
+    char        trace_file[PATH_MAX];
+};
+
+typedef struct _ChargeOptions ChargeOptions;
+
+/* set from the command line by the simulator, the defaults are the device */
+struct _ChargeOptions
+{
+    const char *root;                   /* prefix of every device and data path */
+    struct fb_var_screeninfo mode;      /* framebuffer in memory when xres is set */
+    int         uevent;                 /* uevent socket handed over, -1 for netlink */
+    int         input;                  /* input_event stream handed over, -1 for evdev */
+    int         trace;                  /* spans to trace_marker or the trace file */
 };
 
 static ChargeContext charge_ctx;
+static ChargeOptions charge_opts = { "", { 0 }, -1, -1, 0 };
+
+/* only devices reporting these keys are watched */
+static const int charge_keys[] = { FT_KEY_POWER };
 
 static void power_off()
 {
 #ifdef HAVE_ANDROID_OS
     sync();
     reboot(RB_POWER_OFF);
+#else
+    event_loop_quit();
 #endif
 }
 
-static void update_animation(int status)
+static void invalidate_screen()
+{
+    int i;
+
+    charge_ctx.visible = -1;
+
+    for (i = 0; i < FB_PAGES_MAX; i++)
+        charge_ctx.shown[i] = -1;
+}
+
+/* returns -1 when the frame is not decoded yet */
+static int show_frame(int frame)
+{
+    GifImages *imgs = charge_ctx.images;
+    FBSurface *surf = charge_ctx.surface;
+    int pitch = imgs->w * imgs->depth;
+    int page = surf->page;
+    GifRect rect;
+    const char *src;
+
+    if (frame == charge_ctx.visible)
+        return 0;
+
+    /* decoding narrows the rects, only read them once the frame is out */
+    src = gif_get_frame(imgs, frame);
+
+    if (src == NULL)
+        return -1;
+
+    /* the back page still holds the frame drawn into it two flips ago */
+    if (gif_get_delta(imgs, charge_ctx.shown[page], frame, &rect))
+    {
+        src += rect.y * pitch + rect.x * imgs->depth;
+
+        if (imgs->mode == GIF_MODE_INDEXED)
+        {
+            frame_buffer_blit_lut(surf, charge_ctx.x + rect.x, charge_ctx.y + rect.y, rect.w, rect.h,
+                    (uint8_t *)src, pitch, gif_get_lut(imgs, frame));
+        }
+        else
+        {
+            frame_buffer_blit(surf, charge_ctx.x + rect.x, charge_ctx.y + rect.y,
+                    rect.w, rect.h, src, pitch);
+        }
+    }
+
+    charge_ctx.shown[page] = frame;
+
+    if (frame_buffer_flip() < 0)
+    {
+        invalidate_screen();
+        return show_frame(frame);
+    }
+
+    charge_ctx.visible = frame;
+
+    return 0;
+}
+
+static void show_gauge(int percent)
+{
+    FBSurface *surf = charge_ctx.surface;
+    int page = surf->page;
+
+    if (percent == charge_ctx.visible)
+        return;
+
+    /* like frames, the back page holds what was drawn two flips ago */
+    gauge_draw(&charge_ctx.gauge, surf, charge_ctx.x, charge_ctx.y, charge_ctx.shown[page], percent);
+    charge_ctx.shown[page] = percent;
+
+    if (frame_buffer_flip() < 0)
+    {
+        invalidate_screen();
+        show_gauge(percent);
+        return;
+    }
+
+    charge_ctx.visible = percent;
+}
+
+/* returns how long the frame shown stays up, -1 when the animation stops */
+static int update_animation(int status)
 {
     GifImages *imgs = charge_ctx.images;
     FBSurface *surf = charge_ctx.surface;
     int max = charge_ctx.max_level;
     static int index = 0;
+    int delay;
 
-    if (surf == NULL || imgs == NULL)
-        return;
+    /* nothing is decoded or drawn for a powered down panel */
+    if (surf == NULL || frame_buffer_blanked())
+        return -1;
+
+    /* the gauge follows the capacity, it only changes with the battery */
+    if (charge_ctx.gauge_ready)
+    {
+        show_gauge(status == BATTERY_STATUS_FULL ? 100 : charge_ctx.battery.capacity);
+        return -1;
+    }
+
+    if (imgs == NULL)
+        return -1;
     
     if (status == BATTERY_STATUS_FULL)
     {
-        memcpy(surf->buffer, 
-                imgs->buffer + (imgs->size * max), 
-                imgs->size);
-        return;
+        return show_frame(max) < 0 && gif_decode_pending(imgs) ? CHARGE_FRAME_WAIT : -1;
+    }
+
+    /* wait for a frame still being decoded; one that is corrupt ends the
+     * animation there, the frames after it decode no better */
+    if (show_frame(index) < 0)
+    {
+        if (gif_decode_pending(imgs))
+            return CHARGE_FRAME_WAIT;
+
+        if (index == 0)
+            return -1;
+
+        charge_ctx.max_level = index - 1;
+        index = charge_ctx.battery.capacity * (index - 1) / 100;
+        return CHARGE_FRAME_TIME;
     }
 
-    memcpy(surf->buffer, imgs->buffer + (imgs->size * index), imgs->size);
+    delay = gif_get_delay(imgs, index);
 
     if (++index > max)
     {
-        index = battery_get_capacity() * max / 100;
+        index = charge_ctx.battery.capacity * max / 100;
     }
+
+    return delay > 0 ? delay : CHARGE_FRAME_TIME;
 }
 
-static void *hotplug_thread(void *arg)
+static void charge_on_frame(int fd, void *data)
 {
-    int hotplug_sock = open_hotplug_socket();
+    struct timespec *deadline = &charge_ctx.deadline;
+    struct timespec now;
+    int delay;
+
+    trace_begin("frame");
+    delay = update_animation(charge_ctx.battery.status);
+    trace_end();
+
+    if (delay < 0)
+        return;
+
+    deadline->tv_sec += delay / 1000;
+    deadline->tv_nsec += (delay % 1000) * 1000000L;
 
-    if (hotplug_sock < 0)
+    if (deadline->tv_nsec >= 1000000000L)
     {
-        LOGE("open_hotplug_socket fail, ret=%d", hotplug_sock);
-        return NULL;
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
     }
 
-    while(1)
+    /* fell behind by more than a frame, restart the timeline from now */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (deadline->tv_sec < now.tv_sec ||
+        (deadline->tv_sec == now.tv_sec && deadline->tv_nsec < now.tv_nsec))
     {
-        char buf[4096] = {0};
-        recv(hotplug_sock, &buf, sizeof(buf), 0);
+        *deadline = now;
+    }
 
-        if (strncmp(buf, "remove", strlen("remove")) == 0)
-        {
-            power_off();
-        }
+    event_timer_set_at(fd, deadline);
+}
+
+#ifdef CHARGE_ENABLE_SCREEN
+static void start_animation()
+{
+    if (charge_ctx.frame_timer < 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &charge_ctx.deadline);
+    charge_on_frame(charge_ctx.frame_timer, NULL);
+}
+#endif
+
+static void stop_animation()
+{
+    if (charge_ctx.frame_timer >= 0)
+        event_timer_set(charge_ctx.frame_timer, 0, 0);
+}
+
+static int64_t boottime_ms()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_BOOTTIME, &now);
+
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* the charge rate from the last capacity change, on the boot clock so the
+ * time spent suspended counts */
+static void charge_track_capacity()
+{
+    BatteryState *bat = &charge_ctx.battery;
+    int64_t now;
+
+    if (bat->capacity == charge_ctx.last_capacity)
+        return;
+
+    now = boottime_ms();
+
+    if (charge_ctx.last_capacity >= 0 && bat->capacity > charge_ctx.last_capacity)
+    {
+        charge_ctx.percent_time = (now - charge_ctx.last_change) /
+                                  (bat->capacity - charge_ctx.last_capacity);
     }
 
-    return NULL;
+    charge_ctx.last_capacity = bat->capacity;
+    charge_ctx.last_change = now;
 }
 
-static void charge_on_timer(int signal)
+static void charge_on_battery()
 {
-    static int index = 0;
-    static int sleep = 0;
-    static int full = 0;
+    BatteryState *bat = &charge_ctx.battery;
+
+    charge_track_capacity();
 
-    if (index == 0)
+    if (bat->status == BATTERY_STATUS_NOT_CHARGING)
     {
-        power_lock(CHARGE_WAKE_LOCK);
+        power_off();
+    }
+
 #ifdef CHARGE_ENABLE_SCREEN
-        lcd_gradient(1, charge_ctx.lcd_bright);
+    if (charge_ctx.gauge_ready)
+        update_animation(bat->status);
 #endif
+
+    if (bat->status == BATTERY_STATUS_FULL && charge_ctx.full == 0)
+    {
+#ifdef CHARGE_ENABLE_SCREEN
+        update_animation(bat->status);
+#endif
+        led_effect_set("red", LED_EFFECT_OFF, 0);
+        led_effect_set("green", LED_EFFECT_ON, 0);
+        charge_ctx.full = 1;
     }
+}
 
-    int status = battery_get_status();
+/* seconds until the level shown may change at the current rate, or until
+ * the next check that the battery is still full */
+static int charge_next_alarm()
+{
+    BatteryState *bat = &charge_ctx.battery;
+    int max = charge_ctx.max_level > 0 ? charge_ctx.max_level : 1;
+    int64_t wait;
+    int next;
+
+    if (charge_ctx.full)
+        return CHARGE_ALARM_MAX;
+
+    if (charge_ctx.percent_time <= 0)
+        return CHARGE_ALARM_DEFAULT;
+
+    /* the lowest capacity update_animation maps onto the next level */
+    next = ((bat->capacity * max / 100 + 1) * 100 + max - 1) / max;
+    wait = (next - bat->capacity) * charge_ctx.percent_time -
+           (boottime_ms() - charge_ctx.last_change);
+    wait /= 1000;
+
+    if (wait < CHARGE_ALARM_MIN)
+        return CHARGE_ALARM_MIN;
+
+    return wait > CHARGE_ALARM_MAX ? CHARGE_ALARM_MAX : (int)wait;
+}
+
+/* 0 disarms */
+static void charge_set_alarm(int secs)
+{
+    if (charge_ctx.alarm_rtc)
+        rtc_alarm_set(secs);
+
+    if (charge_ctx.alarm_timer >= 0)
+        event_timer_set(charge_ctx.alarm_timer, secs * 1000, 0);
+}
 
-    if (status == BATTERY_STATUS_NOT_CHARGING)
+static void *charge_store_cache(void *data)
+{
+    uint64_t done = 1;
+
+    frame_cache_store(charge_ctx.frame_cache, &charge_ctx.cache_key, charge_ctx.images);
+
+    if (write(charge_ctx.cache_event, &done, sizeof(done)) < 0)
+        perror("write cache event");
+
+    return NULL;
+}
+
+static void charge_cache_done()
+{
+    charge_ctx.cache_owns = 0;
+
+    /* the gauge has its layers, the frames were only kept for the cache */
+    if (charge_ctx.gauge_ready)
     {
-        power_off();
+        gif_free(charge_ctx.images);
+        charge_ctx.images = NULL;
     }
 
+    power_unlock(CHARGE_CACHE_LOCK);
+}
+
+/* waits for the store thread, the images are the loop's own again */
+static void charge_cache_join()
+{
+    if (!charge_ctx.cache_storing)
+        return;
+
+    trace_begin("frame_cache_join");
+    pthread_join(charge_ctx.cache_thread, NULL);
+    charge_ctx.cache_storing = 0;
+    charge_cache_done();
+    trace_end();
+}
+
+static void charge_on_cache_stored(int fd, void *data)
+{
+    uint64_t done;
+
+    if (read(fd, &done, sizeof(done)) == sizeof(done))
+        charge_cache_join();
+}
+
+/* writes the frame cache on a thread of its own once that cannot race the
+ * animation: every frame decoded, the gauge drawn instead, or idle set
+ * while the animation is stopped, the store then decodes into the ring */
+static void charge_cache_start(int idle)
+{
+    GifImages *imgs = charge_ctx.images;
+
+    if (!charge_ctx.cache_pending || imgs == NULL || charge_ctx.cache_storing ||
+        gif_decode_pending(imgs))
+        return;
+
+    charge_ctx.cache_owns = !charge_ctx.gauge_ready && !gif_decode_complete(imgs);
+
+    if (charge_ctx.cache_owns && !idle)
+        return;
+
+    charge_ctx.cache_pending = 0;
+    power_lock(CHARGE_CACHE_LOCK);
+
+    if (charge_ctx.cache_event >= 0 &&
+        pthread_create(&charge_ctx.cache_thread, NULL, charge_store_cache, NULL) == 0)
+    {
+        charge_ctx.cache_storing = 1;
+        return;
+    }
+
+    /* no thread to spare, store from the loop */
+    trace_begin("frame_cache_store");
+    frame_cache_store(charge_ctx.frame_cache, &charge_ctx.cache_key, imgs);
+    charge_cache_done();
+    trace_end();
+}
+
+static void charge_on_screen_off(void *data)
+{
+    trace_begin("screen_off");
+    stop_animation();
+    event_timer_set(charge_ctx.tick_timer, 0, 0);
+
+    /* a panel that cannot blank is at least dark, the fade ended at 0 */
+    if (frame_buffer_blank(1) < 0)
+        lcd_bright_set(0);
+
+    /* the cache lock keeps the device up until the store is done */
+    charge_cache_start(1);
+
+    charge_ctx.awake = 0;
+    charge_ctx.dimming = 0;
+    charge_set_alarm(charge_next_alarm());
+
+    /* suspend as soon as the wake lock goes */
+    power_sleep();
+    power_unlock(CHARGE_WAKE_LOCK);
+
+    trace_end();
+}
+
+/* open a wake window: screen on, battery ticks, no alarm needed meanwhile;
+ * when already open it starts over */
+static void charge_wake()
+{
+    charge_ctx.ticks = 0;
+
+    /* caught fading out, bring the backlight back up for a new window */
+    if (charge_ctx.dimming)
+    {
+        charge_ctx.dimming = 0;
 #ifdef CHARGE_ENABLE_SCREEN
-    if (full == 0)
-        update_animation(status);
+        fade_start(fade_stop(), charge_ctx.lcd_bright, CHARGE_FADE_TIME, FADE_EASE_OUT, NULL, NULL);
 #endif
+        return;
+    }
+
+    if (charge_ctx.awake)
+        return;
 
-    if (status == BATTERY_STATUS_FULL && full == 0)
+    trace_begin("wake");
+    charge_ctx.awake = 1;
+    power_lock(CHARGE_WAKE_LOCK);
+    power_wake();
+    charge_set_alarm(0);
+
+#ifdef CHARGE_ENABLE_SCREEN
+    /* a store decoding into the ring has to finish before the animation */
+    if (charge_ctx.cache_owns)
+        charge_cache_join();
+
+    /* the panel lost its contents, put up the current frame in full */
+    frame_buffer_blank(0);
+    invalidate_screen();
+    start_animation();
+    fade_start(charge_ctx.lcd_bright / 2, charge_ctx.lcd_bright,
+               CHARGE_FADE_TIME, FADE_EASE_OUT, NULL, NULL);
+#endif
+
+    event_timer_set(charge_ctx.tick_timer, CHARGE_TICK_TIME, CHARGE_TICK_TIME);
+    trace_end();
+}
+
+static void charge_on_timer(int fd, void *data)
+{
+    trace_begin("tick");
+
+    /* without uevents fall back to polling sysfs */
+    if (charge_ctx.hotplug < 0)
     {
-        led_blink_set("red", 0);
-        led_bright_set("green", DEV_LED_FULL);
-        full = 1;
+        trace_begin("battery_poll");
+        battery_get_state(&charge_ctx.battery);
+        charge_on_battery();
+        trace_end();
     }
 
-    if (++index >= CHARGE_WAKE_TIME)
+    /* the worker may have finished since the last tick */
+    charge_cache_start(0);
+
+    if (++charge_ctx.ticks == CHARGE_WAKE_TIME * 1000 / CHARGE_TICK_TIME)
     {
+        /* the wake lock is dropped once the backlight is off */
 #ifdef CHARGE_ENABLE_SCREEN
-        lcd_gradient(0, charge_ctx.lcd_bright);
+        charge_ctx.dimming = 1;
+        fade_start(fade_stop(), 0, CHARGE_FADE_TIME, FADE_EASE_IN, charge_on_screen_off, NULL);
+#else
+        charge_on_screen_off(NULL);
 #endif
+    }
+
+    trace_end();
+}
+
+/* the device woke up for a check only, the lock covers just the sysfs reads */
+static void charge_on_alarm(int fd, void *data)
+{
+    int online = charge_ctx.battery.online;
+
+    trace_begin("alarm");
+    power_lock(CHARGE_WAKE_LOCK);
+
+    battery_get_state(&charge_ctx.battery);
+
+    if (online && !charge_ctx.battery.online)
+        power_off();
+
+    charge_on_battery();
+
+    if (!charge_ctx.awake)
+    {
+        charge_set_alarm(charge_next_alarm());
         power_unlock(CHARGE_WAKE_LOCK);
-        index = 0;
+    }
+
+    trace_end();
+}
+
+static void charge_on_uevent(int fd, void *data)
+{
+    char buf[4096] = {0};
+    int len = recv(fd, buf, sizeof(buf) - 1, 0);
+    int online = charge_ctx.battery.online;
+    int status = charge_ctx.battery.status;
+    UEvent event;
+
+    if (len <= 0)
+        return;
+
+    stats_count(STATS_UEVENTS, 1);
+
+    if (uevent_parse(buf, len + 1, &event) < 0 ||
+        !battery_parse_uevent(&event, &charge_ctx.battery))
+    {
+        stats_count(STATS_UEVENTS_IGNORED, 1);
+        return;
+    }
+
+    /* the last charger went away */
+    if (online && !charge_ctx.battery.online)
+    {
+        LOGI("charger unplugged: %s", event.devpath);
+        power_off();
+    }
+
+    charge_on_battery();
+
+    /* a charger plugged in or the battery full is worth showing */
+    if (online != charge_ctx.battery.online || status != charge_ctx.battery.status)
+        charge_wake();
+}
+
+static void charge_dump_stats()
+{
+    if (charge_ctx.surface)
+        stats_set(STATS_FB_BYTES, charge_ctx.surface->written);
+
+    stats_dump(charge_ctx.stats_file);
+    trace_dump(charge_ctx.trace_file);
+}
+
+static void charge_on_signal(int fd, void *data)
+{
+    charge_dump_stats();
+}
+
+/* the power key shows the animation, pressed again while it is up boots */
+static void charge_on_key(int code, int value)
+{
+    if (code != FT_KEY_POWER || value != 1)
+        return;
+
+    /* a press while the screen goes dark means keep it on, not power on */
+    if (!charge_ctx.awake || charge_ctx.dimming)
+    {
+        charge_wake();
+        return;
+    }
+
+    fade_stop();
+    event_loop_quit();
+}
+
+#ifdef CHARGE_ENABLE_SCREEN
+static GifImages *load_animation(FBSurface *surf)
+{
+    GifImages *imgs = NULL;
+    FrameCacheKey *key = &charge_ctx.cache_key;
+    int cacheable = frame_cache_init_key(key, charge_ctx.animation, CHARGE_FRAME_MODE) == 0;
+    int ring;
+
+    key->filter = CHARGE_SCALE_FILTER;
+
+    if (cacheable)
+    {
+        trace_begin("frame_cache_load");
+        imgs = frame_cache_load(charge_ctx.frame_cache, key);
+        trace_end();
+    }
+
+    if (imgs == NULL)
+    {
+        trace_begin("gif_decode");
+        imgs = gif_decode(charge_ctx.animation, CHARGE_FRAME_MODE, &surf->format);
+        trace_end();
+
+        /* scale once here, the cache then keeps the frames at panel size */
+        if (imgs && !((imgs->w == surf->width && imgs->h <= surf->height) ||
+                      (imgs->h == surf->height && imgs->w <= surf->width)))
+        {
+            GifImages *scaled = scale_images(imgs, surf->width, surf->height,
+                                             CHARGE_SCALE_FILTER, &surf->format);
+
+            if (scaled == NULL)
+                gif_free(imgs);
+
+            imgs = scaled;
+        }
+
+        /* frames are decoded as they are shown, keep as many as fit; a short
+         * animation keeps all of them, each is decoded and scaled only once,
+         * unless the panel is so large that would take too much memory */
+        ring = imgs ? CHARGE_RING_SIZE / imgs->size : 0;
+
+        if (imgs && imgs->count <= CHARGE_RING_PIN && ring < imgs->count &&
+            (uint64_t)imgs->size * imgs->count <= CHARGE_RING_PIN_SIZE)
+            ring = imgs->count;
+
+        if (imgs && gif_set_ring(imgs, ring > 1 ? ring : 1) < 0)
+        {
+            gif_free(imgs);
+            imgs = NULL;
+        }
+
+#ifndef CHARGE_GAUGE
+        /* with room for all frames, decode them ahead of the animation */
+        if (imgs && imgs->ring == imgs->count)
+        {
+            trace_begin("gif_decode_async");
+            gif_decode_async(imgs);
+            trace_end();
+        }
+#endif
+
+        /* storing decodes everything, wait until the screen is off */
+        charge_ctx.cache_pending = imgs && cacheable;
+    }
+
+    return imgs;
+}
+#endif
+
+/* sysfs and netlink setup, run while the main thread maps the framebuffer
+ * and decodes; nothing else may use the device helpers meanwhile */
+static void *charge_init_device(void *data)
+{
+    trace_begin("device_init");
 
-        if (sleep == 0)
+    trace_begin("lcd_bright_get");
+    charge_ctx.lcd_bright = lcd_bright_get();
+    trace_end();
+
+    trace_begin("led_effect_set");
+    led_effect_set("red", LED_EFFECT_BLINK, 2000);
+    trace_end();
+
+    trace_begin("hotplug_socket");
+    charge_ctx.hotplug = charge_opts.uevent >= 0 ? charge_opts.uevent : open_hotplug_socket();
+    trace_end();
+
+    if (charge_ctx.hotplug < 0)
+    {
+        LOGE("open_hotplug_socket fail, ret=%d", charge_ctx.hotplug);
+    }
+    else
+    {
+        event_add(charge_ctx.hotplug, charge_on_uevent, NULL);
+        event_set_name(charge_ctx.hotplug, "uevent");
+        event_set_wakeup(charge_ctx.hotplug);
+    }
+
+    /* the socket only reports changes, start from the current state */
+    trace_begin("battery_get_state");
+    battery_get_state(&charge_ctx.battery);
+    trace_end();
+
+    trace_end();
+
+    return NULL;
+}
+
+/* WxHxBPP, 16 is rgb565 and 32 xrgb8888 */
+static int parse_mode(const char *arg, struct fb_var_screeninfo *vinfo)
+{
+    int w, h, bpp;
+
+    if (sscanf(arg, "%dx%dx%d", &w, &h, &bpp) != 3 || w <= 0 || h <= 0 ||
+        (bpp != 16 && bpp != 32))
+        return -1;
+
+    memset(vinfo, 0, sizeof(*vinfo));
+    vinfo->xres = w;
+    vinfo->yres = h;
+    vinfo->bits_per_pixel = bpp;
+    vinfo->red.offset = bpp == 16 ? 11 : 16;
+    vinfo->red.length = bpp == 16 ? 5 : 8;
+    vinfo->green.offset = bpp == 16 ? 5 : 8;
+    vinfo->green.length = bpp == 16 ? 6 : 8;
+    vinfo->blue.offset = 0;
+    vinfo->blue.length = bpp == 16 ? 5 : 8;
+
+    return 0;
+}
+
+static int parse_options(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:f:u:i:t")) != -1)
+    {
+        switch (opt)
         {
-            power_sleep(CHARGE_WAKE_TIME);
-            sleep = 1;
+            case 'r':
+                charge_opts.root = optarg;
+                break;
+
+            case 'f':
+                if (parse_mode(optarg, &charge_opts.mode) < 0)
+                    return -1;
+                break;
+
+            case 'u':
+                charge_opts.uevent = atoi(optarg);
+                break;
+
+            case 'i':
+                charge_opts.input = atoi(optarg);
+                break;
+
+            case 't':
+                charge_opts.trace = 1;
+                break;
+
+            default:
+                return -1;
         }
     }
 
-    alarm(1); 
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
+#ifdef CHARGE_ENABLE_SCREEN
     GifImages *imgs = NULL;
     FBSurface *surf = NULL;
-    pthread_t tid = 0;
+#endif
+    pthread_t device;
+    int threaded;
+
+    if (parse_options(argc, argv) < 0)
+    {
+        fprintf(stderr, "usage: %s [-r root] [-f WxHxBPP] [-u uevent fd] [-i input fd] [-t]\n", argv[0]);
+        return 1;
+    }
+
+    device_set_root(charge_opts.root);
+    snprintf(charge_ctx.animation, PATH_MAX, "%s%s", charge_opts.root, CHARGE_ANIMATION);
+    snprintf(charge_ctx.frame_cache, PATH_MAX, "%s%s", charge_opts.root, CHARGE_FRAME_CACHE);
+    snprintf(charge_ctx.stats_file, PATH_MAX, "%s%s", charge_opts.root, CHARGE_STATS_FILE);
+    snprintf(charge_ctx.trace_file, PATH_MAX, "%s%s", charge_opts.root, CHARGE_TRACE_FILE);
+    stats_init();
+
+    if (charge_opts.trace && trace_init(charge_opts.root) < 0)
+        LOGI("no tracefs, keeping the trace in %s", charge_ctx.trace_file);
+
+    trace_begin("startup");
 
     charge_ctx.max_level = CHARGE_LEVEL_MAX;
-    charge_ctx.lcd_bright = lcd_bright_get();
+    charge_ctx.frame_timer = -1;
+    charge_ctx.tick_timer = -1;
+    charge_ctx.alarm_timer = -1;
+    charge_ctx.last_capacity = -1;
+    invalidate_screen();
+
+    if (event_loop_init() < 0)
+    {
+        LOGE("event_loop_init fail");
+        return 1;
+    }
+
+    /* before any thread starts, they all have to block the signal */
+    event_signal_create(SIGUSR1, charge_on_signal, NULL);
+
+    threaded = pthread_create(&device, NULL, charge_init_device, NULL) == 0;
+
+    if (!threaded)
+        charge_init_device(NULL);
 
 #ifdef CHARGE_ENABLE_SCREEN
-    surf = frame_buffer_get_default();
-    imgs = gif_decode(CHARGE_ANIMATION);
+    trace_begin("framebuffer_open");
+
+    if (charge_opts.mode.xres)
+        surf = frame_buffer_get_memory(&charge_opts.mode);
+    else
+        surf = frame_buffer_get_default();
+
+    trace_end();
+    trace_begin("load_animation");
 
-    if (surf->width == imgs->w || surf->height == imgs->h)
+    if (surf)
+        imgs = load_animation(surf);
+
+    trace_end();
+
+    if (imgs && imgs->w <= surf->width && imgs->h <= surf->height)
     {
-        charge_ctx.images = imgs;
+        charge_ctx.x = (surf->width - imgs->w) / 2;
+        charge_ctx.y = (surf->height - imgs->h) / 2;
         charge_ctx.max_level = imgs->count - 1;
+
+#ifdef CHARGE_GAUGE
+        /* two layers take the place of every frame */
+        trace_begin("gauge_init");
+
+        if (gauge_init(&charge_ctx.gauge, imgs, &surf->format) == 0)
+        {
+            charge_ctx.gauge_ready = 1;
+
+            /* the gauge moves in 1% steps, wake for each of them */
+            charge_ctx.max_level = 100;
+
+            /* decoded frames stay until they are stored in the cache */
+            if (!charge_ctx.cache_pending)
+            {
+                gif_free(imgs);
+                imgs = NULL;
+            }
+        }
+
+        trace_end();
+#endif
+
+        charge_ctx.images = imgs;
+    }
+    else
+    {
+        gif_free(imgs);
     }
 
     charge_ctx.surface = surf;
-#else
+#endif
+
+    trace_begin("device_join");
+
+    if (threaded)
+        pthread_join(device, NULL);
+
+    trace_end();
+
+#ifndef CHARGE_ENABLE_SCREEN
     lcd_bright_set(0);
 #endif
 
-    led_blink_set("red", 1);
-    pthread_create(&tid, NULL, hotplug_thread, NULL);
-    signal(SIGALRM, charge_on_timer);
-    alarm(1);
+    fade_init();
+
+    charge_on_battery();
+
+    /* frames follow their own delays, the tick only samples the battery */
+    charge_ctx.frame_timer = event_timer_create(CLOCK_MONOTONIC, charge_on_frame, NULL);
+    event_set_name(charge_ctx.frame_timer, "frame");
+
+    if (charge_opts.input >= 0)
+        input_add_fd(charge_opts.input, charge_on_key);
+    else
+        input_init(charge_on_key, charge_keys, sizeof(charge_keys) / sizeof(charge_keys[0]));
+
+    charge_ctx.tick_timer = event_timer_create(CLOCK_MONOTONIC, charge_on_timer, NULL);
+    event_set_name(charge_ctx.tick_timer, "tick");
+
+    /* an alarm clock wakes the device from suspend by itself, a plain boot
+     * clock timer needs the rtc to do that */
+    charge_ctx.alarm_timer = event_timer_create(CLOCK_BOOTTIME_ALARM, charge_on_alarm, NULL);
+
+    if (charge_ctx.alarm_timer < 0)
+    {
+        charge_ctx.alarm_rtc = 1;
+        charge_ctx.alarm_timer = event_timer_create(CLOCK_BOOTTIME, charge_on_alarm, NULL);
+    }
+
+    event_set_name(charge_ctx.alarm_timer, "alarm");
+
+    /* the handler takes the wake lock, nothing holds the device before it */
+    event_set_wakeup(charge_ctx.alarm_timer);
+
+    charge_ctx.cache_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (charge_ctx.cache_event >= 0)
+    {
+        event_add(charge_ctx.cache_event, charge_on_cache_stored, NULL);
+        event_set_name(charge_ctx.cache_event, "cache");
+    }
+
+    /* put the first frame up now rather than a tick later */
+    trace_begin("first_frame");
+    charge_wake();
+    trace_end();
+
+    /* the gauge no longer needs the frames, they can go to the cache now */
+    charge_cache_start(0);
+
+    trace_end();
 
     // event loop
-    wait_onkey();
+    event_loop_run();
+
+    /* booting before the first screen-off still leaves a cache behind */
+    charge_cache_start(1);
+    charge_cache_join();
 
     // power on device
     power_lock("PowerManagerService");
     power_unlock(CHARGE_WAKE_LOCK);
 
     lcd_bright_set(charge_ctx.lcd_bright);
-    led_bright_set("red", 0);
-    led_bright_set("green", 0);
+    led_effect_set("red", LED_EFFECT_OFF, 0);
+    led_effect_set("green", LED_EFFECT_OFF, 0);
     vibrator_set(500);
 
+    charge_dump_stats();
     frame_buffer_close();
-    free(imgs);
+    gauge_free(&charge_ctx.gauge);
+    gif_free(charge_ctx.images);
 
     return 0;
 }
-
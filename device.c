@@ -1,86 +1,150 @@
 #include "device.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <limits.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 
 #define BUF_LEN_MAX     256
+#define DEV_ATTR_MAX    24
+#define DEV_PATH_MAX    128
 
-char *hw_file_read(const char *file, size_t len)
+typedef struct _DevAttr DevAttr;
+
+/* sysfs nodes are opened once and then read and written at offset 0, which
+ * makes the kernel regenerate or store the attribute without a path walk */
+struct _DevAttr
 {
-    char buf[BUF_LEN_MAX+1];
-    ssize_t size;
+    char    path[DEV_PATH_MAX];
+    int     flags;
+    int     fd;
+};
 
-    int fd = open(file, O_RDONLY);
+static DevAttr dev_attrs[DEV_ATTR_MAX];
+static int dev_attr_next = 0;
+static char dev_root[PATH_MAX];
 
-    if (fd < 0)
+void device_set_root(const char *root)
+{
+    snprintf(dev_root, sizeof(dev_root), "%s", root ? root : "");
+}
+
+const char *device_get_root()
+{
+    return dev_root;
+}
+
+static int hw_file_open(const char *file, int flags)
+{
+    char path[PATH_MAX];
+    DevAttr *attr;
+    int i, fd;
+
+    for (i = 0; i < DEV_ATTR_MAX; i++)
     {
-        perror(file);
-        return NULL;
+        attr = &dev_attrs[i];
+
+        if (attr->path[0] && attr->flags == flags && strcmp(attr->path, file) == 0)
+            return attr->fd;
     }
 
-    if (len == 0 || len > BUF_LEN_MAX)
+    snprintf(path, sizeof(path), "%s%s", dev_root, file);
+
+    fd = open(path, flags | O_CLOEXEC);
+
+    if (fd < 0)
     {
-        len = BUF_LEN_MAX;
+        perror(path);
+        return -1;
     }
 
-    size = read(fd, buf, len);
-    close(fd);
+    if (strlen(file) >= DEV_PATH_MAX)
+        return fd;
 
-    if (size > 0)
-    {
-        if (buf[size] == '\n')
-            buf[size] = '\0';
-        else
-            buf[size+1] = '\0';
+    /* the table is full with only a few leds around, recycle in order */
+    attr = &dev_attrs[dev_attr_next];
+    dev_attr_next = (dev_attr_next + 1) % DEV_ATTR_MAX;
 
-        return strdup(buf);
-    }
+    if (attr->path[0])
+        close(attr->fd);
+
+    strcpy(attr->path, file);
+    attr->flags = flags;
+    attr->fd = fd;
 
-    return NULL;
+    return fd;
 }
 
-int hw_file_read_int(const char *file, size_t len)
+static void hw_file_release(const char *file, int fd)
 {
-    char *text = hw_file_read(file, len);
-    int value = 0;
+    /* only paths too long for the table are left uncached */
+    if (strlen(file) >= DEV_PATH_MAX)
+        close(fd);
+}
 
-    if (text)
+int hw_file_read(const char *file, char *buf, size_t len)
+{
+    uint64_t start = stats_now();
+    ssize_t size;
+    int fd = hw_file_open(file, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    size = pread(fd, buf, len - 1, 0);
+    hw_file_release(file, fd);
+    stats_record(STATS_SYSFS_READ, start);
+
+    if (size <= 0)
     {
-        value = atoi(text);
-        free(text);
+        buf[0] = '\0';
+        return -1;
     }
 
-    return value;
+    if (buf[size - 1] == '\n')
+        size--;
+
+    buf[size] = '\0';
+
+    return size;
+}
+
+int hw_file_read_int(const char *file)
+{
+    char buf[16];
+
+    if (hw_file_read(file, buf, sizeof(buf)) < 0)
+        return 0;
+
+    return strtol(buf, NULL, 10);
 }
 
 int hw_file_write(const char *file, const char *content)
 {
+    uint64_t start = stats_now();
     ssize_t size;
-
-    int fd = open(file, O_WRONLY);
+    int fd = hw_file_open(file, O_WRONLY);
 
     if (fd < 0)
-    {
-        perror(file);
         return -1;
-    }
 
-    size = write(fd, content, strlen(content));
-    close(fd);
+    size = pwrite(fd, content, strlen(content), 0);
+    hw_file_release(file, fd);
+    stats_record(STATS_SYSFS_WRITE, start);
 
     return size;
 }
 
 int hw_file_write_int(const char *file, int value)
 {
-    char buf[BUF_LEN_MAX];
+    char buf[16];
 
-    sprintf(buf, "%d", value);
+    snprintf(buf, sizeof(buf), "%d", value);
 
     return hw_file_write(file, buf);
 }
@@ -113,19 +177,15 @@ int open_hotplug_socket()
         return -1;
     }
 
+    /* keep unrelated devices from waking us up, parsing copes without it */
+    uevent_attach_filter(s);
+
     return s;
 }
 
-int battery_get_status()
+static int battery_parse_status(const char *text)
 {
-    static char *status[] = {"Unknown", "Charging", "Discharging", "Not charging", "Full", NULL};
-
-    char *text = hw_file_read(DEV_BATTERY_STATUS, 16);
-
-    if (!text)
-        return BATTERY_STATUS_UNKNOW;
-
-    switch (*text)
+    switch (text[0])
     {
         case 'U':
             return BATTERY_STATUS_UNKNOW;
@@ -145,110 +205,122 @@ int battery_get_status()
         default: break;
     }
 
-    free(text);
-
     return BATTERY_STATUS_UNKNOW;
 }
 
-int battery_get_capacity()
+int battery_get_status()
 {
-    return hw_file_read_int(DEV_BATTERY_CAPACITY, 16);
+    char text[16];
+
+    if (hw_file_read(DEV_BATTERY_STATUS, text, sizeof(text)) < 0)
+        return BATTERY_STATUS_UNKNOW;
+
+    return battery_parse_status(text);
 }
 
-int lcd_bright_get()
+int battery_get_capacity()
 {
-    return hw_file_read_int(DEV_LCD_BRIGHT, 16);
+    return hw_file_read_int(DEV_BATTERY_CAPACITY);
 }
 
-void lcd_bright_set(int bright)
+void battery_get_state(BatteryState *state)
 {
-    hw_file_write_int(DEV_LCD_BRIGHT, bright);
+    state->status = battery_get_status();
+    state->capacity = battery_get_capacity();
+    state->online = 0;
+
+    if (hw_file_read_int(DEV_AC_ONLINE))
+        state->online |= BATTERY_CHARGER_AC;
+
+    if (hw_file_read_int(DEV_USB_ONLINE))
+        state->online |= BATTERY_CHARGER_USB;
 }
 
-void lcd_gradient(int sw, int limit)
+/* the supplies battery_get_state reads, whatever type they report */
+static int battery_parse_name(const char *name)
 {
-    int interval = 500000 / limit;
-    int i = 0;
+    if (strcmp(name, "ac") == 0)
+        return BATTERY_CHARGER_AC;
 
-    if (sw)
-    {
-        for (i = limit / 2; i <= limit; i++)
-        {
-            lcd_bright_set(i);
-            usleep(interval);
-        }
-    }
-    else
-    {
-        for (i = limit; i >= 0; i--)
-        {
-            lcd_bright_set(i);
-            usleep(interval);
-        }
-    }
+    if (strcmp(name, "usb") == 0)
+        return BATTERY_CHARGER_USB;
+
+    return 0;
 }
 
-void led_bright_set(const char *name, int value)
+static int battery_parse_type(const char *type)
 {
-    char device[PATH_MAX];
+    if (strcmp(type, "Mains") == 0)
+        return BATTERY_CHARGER_AC;
+
+    if (strncmp(type, "USB", 3) == 0)
+        return BATTERY_CHARGER_USB;
 
-    snprintf(device, PATH_MAX, DEV_LED_PATH"/%s/brightness", name);
+    if (strcmp(type, "Wireless") == 0)
+        return BATTERY_CHARGER_WIRELESS;
 
-    hw_file_write_int(device, value);
+    return BATTERY_CHARGER_OTHER;
 }
 
-void led_blink_set(const char *name, int set)
+int battery_parse_uevent(const UEvent *event, BatteryState *state)
 {
-    char device[PATH_MAX];
+    const char *status, *capacity, *online, *type, *name;
 
-    if (set == 0)
-    {
-        led_bright_set(name, 0);
-        return;
-    }
+    if (event->subsystem == NULL || strcmp(event->subsystem, "power_supply") != 0)
+        return 0;
+
+    status = uevent_get(event, "POWER_SUPPLY_STATUS");
+    capacity = uevent_get(event, "POWER_SUPPLY_CAPACITY");
+    online = uevent_get(event, "POWER_SUPPLY_ONLINE");
+    type = uevent_get(event, "POWER_SUPPLY_TYPE");
+    name = uevent_get(event, "POWER_SUPPLY_NAME");
 
-    snprintf(device, PATH_MAX, DEV_LED_PATH"/%s/trigger", name);
-    hw_file_write(device, "timer");
+    if (name == NULL && event->devpath)
+        name = strrchr(event->devpath, '/') ? strrchr(event->devpath, '/') + 1 : event->devpath;
 
-    snprintf(device, PATH_MAX, DEV_LED_PATH"/%s/brightness", name);
-    hw_file_write_int(device, DEV_LED_FULL);
+    if (status)
+        state->status = battery_parse_status(status);
 
-    snprintf(device, PATH_MAX, DEV_LED_PATH"/%s/delay_on", name);
-    hw_file_write_int(device, 1000);
+    if (capacity)
+        state->capacity = strtol(capacity, NULL, 10);
 
-    snprintf(device, PATH_MAX, DEV_LED_PATH"/%s/delay_off", name);
-    hw_file_write_int(device, 1000);
+    /* the battery itself has no online attribute, chargers do; they are
+     * keyed by name like the startup snapshot, some kernels leave out the
+     * type, and only chargers known by neither go as other */
+    if (online && !(type && strcmp(type, "Battery") == 0))
+    {
+        int mask = name ? battery_parse_name(name) : 0;
+
+        if (mask == 0)
+            mask = type ? battery_parse_type(type) : BATTERY_CHARGER_OTHER;
+
+        if (strtol(online, NULL, 10))
+            state->online |= mask;
+        else
+            state->online &= ~mask;
+    }
 
-    return;
+    return 1;
 }
 
-int light_get_max()
+int lcd_bright_get()
 {
-    return DEV_LED_FULL;
+    return hw_file_read_int(DEV_LCD_BRIGHT);
 }
 
-void light_set(int bright)
+void lcd_bright_set(int bright)
 {
-    hw_file_write_int(DEV_LIGHT_BRIGHT, bright);
+    hw_file_write_int(DEV_LCD_BRIGHT, bright);
 }
 
-void light_breathe(int orient)
+int lcd_bright_max()
 {
-    int max = light_get_max();
-    int interval = 1000000 / max;
-    int i = 0;
+    static int max = 0;
 
-    for (i = 0; i < max; i++)
-    {
-        light_set(i);
-        usleep(interval);
-    }
+    if (max <= 0)
+        max = hw_file_read_int(DEV_LCD_BRIGHT_MAX);
 
-    for (i = max; i > 0; i--)
-    {
-        light_set(i);
-        usleep(interval);
-    }
+    return max > 0 ? max : DEV_LED_FULL;
 }
 
 void vibrator_set(int status)
@@ -256,11 +328,16 @@ void vibrator_set(int status)
     hw_file_write_int(DEV_VIBRATOR, status);
 }
 
-void power_sleep(long time)
+void power_sleep()
 {
     hw_file_write(DEV_POWER_STATE, "mem");
 }
 
+void power_wake()
+{
+    hw_file_write(DEV_POWER_STATE, "on");
+}
+
 void power_lock(const char *reason)
 {
     hw_file_write(DEV_POWER_LOCK, reason);
@@ -271,3 +348,18 @@ void power_unlock(const char *reason)
     hw_file_write(DEV_POWER_UNLOCK, reason);
 }
 
+int rtc_alarm_set(int secs)
+{
+    char buf[16];
+
+    /* a pending alarm has to be cleared before the next one is accepted */
+    if (hw_file_write(DEV_RTC_WAKEALARM, "0") < 0)
+        return -1;
+
+    if (secs <= 0)
+        return 0;
+
+    snprintf(buf, sizeof(buf), "+%d", secs);
+
+    return hw_file_write(DEV_RTC_WAKEALARM, buf) < 0 ? -1 : 0;
+}
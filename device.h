@@ -1,14 +1,21 @@
+#include "uevent.h"
+
+#include <stddef.h>
+
 #ifndef _DEVICE_H_
 #define _DEVICE_H_
 
 #define DEV_BATTERY_STATUS      "/sys/class/power_supply/battery/status"
 #define DEV_BATTERY_CAPACITY    "/sys/class/power_supply/battery/capacity"
-#define DEV_LIGHT_BRIGHT        "/sys/class/leds/jogball-backlight/brightness"
+#define DEV_AC_ONLINE           "/sys/class/power_supply/ac/online"
+#define DEV_USB_ONLINE          "/sys/class/power_supply/usb/online"
 #define DEV_POWER_STATE         "/sys/power/state"
 #define DEV_POWER_LOCK          "/sys/power/wake_lock"
 #define DEV_POWER_UNLOCK        "/sys/power/wake_unlock"
 #define DEV_VIBRATOR            "/sys/class/timed_output/vibrator/enable"
 #define DEV_LCD_BRIGHT          "/sys/class/backlight/micco-bl/brightness"
+#define DEV_LCD_BRIGHT_MAX      "/sys/class/backlight/micco-bl/max_brightness"
+#define DEV_RTC_WAKEALARM       "/sys/class/rtc/rtc0/wakealarm"
 
 #define DEV_LED_PATH            "/sys/class/leds/"
 #define DEV_LED_FULL            255
@@ -22,34 +29,65 @@ enum
     BATTERY_STATUS_FULL,
 };
 
-int open_hotplug_socket();
+enum
+{
+    BATTERY_CHARGER_AC          = 1 << 0,
+    BATTERY_CHARGER_USB         = 1 << 1,
+    BATTERY_CHARGER_WIRELESS    = 1 << 2,
+    BATTERY_CHARGER_OTHER       = 1 << 3,
+};
 
-int battery_get_status();
+typedef struct _BatteryState BatteryState;
 
-int battery_get_capacity();
+struct _BatteryState
+{
+    int     status;
+    int     capacity;
+    int     online;     /* BATTERY_CHARGER_* mask of plugged chargers */
+};
 
-int lcd_bright_get();
+/* every DEV_* path is looked up below root, "" for the real device */
+void device_set_root(const char *root);
 
-void lcd_bright_set(int bright);
+const char *device_get_root();
 
-void lcd_gradient(int sw, int limit);
+int hw_file_read(const char *file, char *buf, size_t len);
 
-void led_bright_set(const char *name, int value);
+int hw_file_read_int(const char *file);
 
-void led_blink_set(const char *name, int set);
+int hw_file_write(const char *file, const char *content);
 
-int light_get_max();
+int hw_file_write_int(const char *file, int value);
 
-void light_set(int bright);
+int open_hotplug_socket();
 
-void light_breathe();
+int battery_get_status();
+
+int battery_get_capacity();
+
+void battery_get_state(BatteryState *state);
+
+/* update state from a power_supply uevent, returns 0 for other events */
+int battery_parse_uevent(const UEvent *event, BatteryState *state);
+
+int lcd_bright_get();
+
+void lcd_bright_set(int bright);
+
+int lcd_bright_max();
 
 void vibrator_set(int status);
 
-void power_sleep(long time);
+/* suspend whenever no wake lock is held, until power_wake */
+void power_sleep();
+
+void power_wake();
 
 void power_lock(const char *reason);
 
 void power_unlock(const char *reason);
 
+/* wake from suspend in secs, 0 clears the alarm */
+int rtc_alarm_set(int secs);
+
 #endif/*_DEVICE_H_*/
@@ -0,0 +1,300 @@
+#include "event.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#ifndef EPOLLWAKEUP
+#define EPOLLWAKEUP (1u << 29)
+#endif
+
+enum
+{
+    EVENT_KIND_FD = 0,
+    EVENT_KIND_TIMER,
+    EVENT_KIND_SIGNAL,
+};
+
+typedef struct _EventSource EventSource;
+
+struct _EventSource
+{
+    int         fd;
+    int         timer;
+    int         signal;
+    int         hist;       /* stats histogram of the handler */
+    EventFunc   func;
+    void       *data;
+};
+
+struct EventContext
+{
+    int         epfd;
+    int         quit;
+    EventSource sources[EVENT_SOURCE_MAX];
+};
+
+static struct EventContext event_ctx;
+
+int event_loop_init()
+{
+    int i;
+
+    if (event_ctx.epfd > 0)
+        return 0;
+
+    event_ctx.epfd = epoll_create(EVENT_SOURCE_MAX);
+
+    if (event_ctx.epfd < 0)
+    {
+        perror("epoll_create");
+        return -1;
+    }
+
+    for (i = 0; i < EVENT_SOURCE_MAX; i++)
+        event_ctx.sources[i].fd = -1;
+
+    return 0;
+}
+
+static int event_add_source(int fd, int kind, EventFunc func, void *data)
+{
+    struct epoll_event ev;
+    EventSource *src = NULL;
+    int i;
+
+    for (i = 0; i < EVENT_SOURCE_MAX && src == NULL; i++)
+    {
+        if (event_ctx.sources[i].fd < 0)
+            src = &event_ctx.sources[i];
+    }
+
+    if (src == NULL)
+    {
+        printf("too many event sources\n");
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+
+    if (epoll_ctl(event_ctx.epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    src->fd = fd;
+    src->timer = kind == EVENT_KIND_TIMER;
+    src->signal = kind == EVENT_KIND_SIGNAL;
+    src->hist = STATS_HANDLER_OTHER;
+    src->func = func;
+    src->data = data;
+
+    return 0;
+}
+
+int event_add(int fd, EventFunc func, void *data)
+{
+    return event_add_source(fd, EVENT_KIND_FD, func, data);
+}
+
+void event_set_name(int fd, const char *name)
+{
+    int i;
+
+    if (fd < 0)
+        return;
+
+    for (i = 0; i < EVENT_SOURCE_MAX; i++)
+    {
+        if (event_ctx.sources[i].fd == fd)
+            event_ctx.sources[i].hist = stats_hist(name);
+    }
+}
+
+int event_set_wakeup(int fd)
+{
+    struct epoll_event ev;
+    int i;
+
+    if (fd < 0)
+        return -1;
+
+    for (i = 0; i < EVENT_SOURCE_MAX; i++)
+    {
+        if (event_ctx.sources[i].fd != fd)
+            continue;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLWAKEUP;
+        ev.data.ptr = &event_ctx.sources[i];
+
+        /* without CAP_BLOCK_SUSPEND the kernel drops the flag quietly */
+        if (epoll_ctl(event_ctx.epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl EPOLLWAKEUP");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+void event_remove(int fd)
+{
+    int i;
+
+    for (i = 0; i < EVENT_SOURCE_MAX; i++)
+    {
+        if (event_ctx.sources[i].fd == fd)
+        {
+            epoll_ctl(event_ctx.epfd, EPOLL_CTL_DEL, fd, NULL);
+            event_ctx.sources[i].fd = -1;
+        }
+    }
+}
+
+int event_timer_create(int clockid, EventFunc func, void *data)
+{
+    int fd = timerfd_create(clockid, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    if (event_add_source(fd, EVENT_KIND_TIMER, func, data) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int event_signal_create(int signo, EventFunc func, void *data)
+{
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+    {
+        perror("sigprocmask");
+        return -1;
+    }
+
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (fd < 0)
+    {
+        perror("signalfd");
+        return -1;
+    }
+
+    if (event_add_source(fd, EVENT_KIND_SIGNAL, func, data) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int event_timer_set(int fd, int msecs, int interval)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = msecs / 1000;
+    its.it_value.tv_nsec = (msecs % 1000) * 1000000L;
+    its.it_interval.tv_sec = interval / 1000;
+    its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+
+    return timerfd_settime(fd, 0, &its, NULL);
+}
+
+int event_timer_set_at(int fd, const struct timespec *when)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value = *when;
+
+    return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void event_loop_run()
+{
+    struct epoll_event events[EVENT_SOURCE_MAX];
+    int i, n;
+
+    event_ctx.quit = 0;
+
+    while (!event_ctx.quit)
+    {
+        n = epoll_wait(event_ctx.epfd, events, EVENT_SOURCE_MAX, -1);
+
+        if (n < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("epoll_wait");
+                return;
+            }
+
+            continue;
+        }
+
+        for (i = 0; i < n && !event_ctx.quit; i++)
+        {
+            EventSource *src = events[i].data.ptr;
+            uint64_t start;
+
+            /* removed by an earlier handler of this round */
+            if (src->fd < 0)
+                continue;
+
+            if (src->timer)
+            {
+                uint64_t expired;
+
+                if (read(src->fd, &expired, sizeof(expired)) != sizeof(expired))
+                    continue;
+
+                stats_count(STATS_TIMER_TICKS, expired);
+                stats_count(STATS_TIMER_OVERRUNS, expired - 1);
+            }
+            else if (src->signal)
+            {
+                struct signalfd_siginfo info;
+
+                if (read(src->fd, &info, sizeof(info)) != sizeof(info))
+                    continue;
+            }
+
+            start = stats_now();
+            src->func(src->fd, src->data);
+            stats_record(src->hist, start);
+        }
+    }
+}
+
+void event_loop_quit()
+{
+    event_ctx.quit = 1;
+}
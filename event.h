@@ -0,0 +1,40 @@
+#include <time.h>
+
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#define EVENT_SOURCE_MAX    32
+
+typedef void (*EventFunc)(int fd, void *data);
+
+int event_loop_init();
+
+int event_add(int fd, EventFunc func, void *data);
+
+/* time spent in the source's handler goes to the stats histogram of name */
+void event_set_name(int fd, const char *name);
+
+/* keep the system from suspending from the moment the source is ready
+ * until the loop waits again, so its handler runs before the next suspend */
+int event_set_wakeup(int fd);
+
+void event_remove(int fd);
+
+/* a timerfd on the given clock registered with the loop, func runs on expiry */
+int event_timer_create(int clockid, EventFunc func, void *data);
+
+/* a signalfd for signo, blocked in the calling thread; threads created
+ * afterwards inherit the mask, so call it early in main */
+int event_signal_create(int signo, EventFunc func, void *data);
+
+int event_timer_set(int fd, int msecs, int interval);
+
+/* one shot at an absolute time of the timer's clock, so rearming from a
+ * late handler does not push every later deadline back */
+int event_timer_set_at(int fd, const struct timespec *when);
+
+void event_loop_run();
+
+void event_loop_quit();
+
+#endif/*_EVENT_H_*/
@@ -0,0 +1,147 @@
+#include "fade.h"
+#include "event.h"
+#include "device.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define FADE_ONE    1024    /* fixed point 1.0 of the curves */
+
+struct FadeContext
+{
+    int         timer;
+    int         active;
+    int         from, to, level;
+    int         curve;
+    int         msecs;
+    struct timespec start;
+    FadeFunc    done;
+    void       *data;
+};
+
+static struct FadeContext fade_ctx = { .timer = -1 };
+
+static int fade_ease(int curve, int t)
+{
+    switch (curve)
+    {
+        case FADE_EASE_IN:
+            return t * t / FADE_ONE;
+
+        case FADE_EASE_OUT:
+            return FADE_ONE - (FADE_ONE - t) * (FADE_ONE - t) / FADE_ONE;
+
+        case FADE_EASE_IN_OUT:
+            /* smoothstep, 3t^2 - 2t^3 */
+            return (int)((int64_t)t * t * (3 * FADE_ONE - 2 * t) / ((int64_t)FADE_ONE * FADE_ONE));
+
+        default: break;
+    }
+
+    return t;
+}
+
+static int fade_elapsed()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - fade_ctx.start.tv_sec) * 1000 +
+           (now.tv_nsec - fade_ctx.start.tv_nsec) / 1000000;
+}
+
+static void fade_on_timer(int fd, void *data)
+{
+    int elapsed = fade_elapsed();
+    int t, level;
+
+    if (!fade_ctx.active)
+        return;
+
+    t = elapsed >= fade_ctx.msecs ? FADE_ONE : elapsed * FADE_ONE / fade_ctx.msecs;
+    level = fade_ctx.from + (fade_ctx.to - fade_ctx.from) * fade_ease(fade_ctx.curve, t) / FADE_ONE;
+
+    /* levels are in the panel's own units, so steps that round to the same
+     * value are coalesced into a single write */
+    if (level != fade_ctx.level)
+    {
+        lcd_bright_set(level);
+        fade_ctx.level = level;
+    }
+
+    if (t == FADE_ONE)
+    {
+        fade_ctx.active = 0;
+        event_timer_set(fade_ctx.timer, 0, 0);
+
+        if (fade_ctx.done)
+            fade_ctx.done(fade_ctx.data);
+    }
+}
+
+int fade_init()
+{
+    if (fade_ctx.timer >= 0)
+        return 0;
+
+    fade_ctx.timer = event_timer_create(CLOCK_MONOTONIC, fade_on_timer, NULL);
+    event_set_name(fade_ctx.timer, "fade");
+
+    return fade_ctx.timer < 0 ? -1 : 0;
+}
+
+void fade_start(int from, int to, int msecs, int curve, FadeFunc done, void *data)
+{
+    int max = lcd_bright_max();
+
+    if (to > max)
+        to = max;
+
+    if (from > max)
+        from = max;
+
+    fade_ctx.from = from;
+    fade_ctx.to = to;
+    fade_ctx.curve = curve;
+    fade_ctx.msecs = msecs > 0 ? msecs : 1;
+    fade_ctx.done = done;
+    fade_ctx.data = data;
+
+    if (fade_ctx.timer < 0 || from == to)
+    {
+        /* nothing to animate, or no loop to animate on */
+        fade_ctx.active = 0;
+        fade_ctx.level = to;
+        lcd_bright_set(to);
+
+        if (done)
+            done(data);
+
+        return;
+    }
+
+    fade_ctx.level = from;
+    fade_ctx.active = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &fade_ctx.start);
+    lcd_bright_set(from);
+    event_timer_set(fade_ctx.timer, FADE_STEP_MS, FADE_STEP_MS);
+}
+
+int fade_stop()
+{
+    if (fade_ctx.active)
+    {
+        fade_ctx.active = 0;
+        event_timer_set(fade_ctx.timer, 0, 0);
+    }
+
+    return fade_ctx.level;
+}
+
+int fade_active()
+{
+    return fade_ctx.active;
+}
@@ -0,0 +1,27 @@
+#ifndef _FADE_H_
+#define _FADE_H_
+
+#define FADE_STEP_MS    16
+
+enum
+{
+    FADE_LINEAR = 0,
+    FADE_EASE_IN,
+    FADE_EASE_OUT,
+    FADE_EASE_IN_OUT,
+};
+
+typedef void (*FadeFunc)(void *data);
+
+int fade_init();
+
+/* move the backlight from one level to another without blocking, done runs
+ * once the target is reached but not when the fade is stopped */
+void fade_start(int from, int to, int msecs, int curve, FadeFunc done, void *data);
+
+/* leave the backlight where it is, returns the current level */
+int fade_stop();
+
+int fade_active();
+
+#endif/*_FADE_H_*/
@@ -1,30 +1,49 @@
 #include "framebuffer.h"
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #define FRAMEBUFFER_DEV_NAME    "/dev/graphics/fb0"
 
 struct FBContext
 {
     int                         fd;
     int                         screen_size;
+    int                         page_size;
+    int                         origin;
+    int                         map_size;
+    int                         vsync;
+    int                         memory;     /* no device behind it, skip the ioctls */
+    int                         blanked;
     char                       *buffer;
     char                       *saved;
+    char                       *row;       /* a cached scanline indexed frames expand into */
     struct fb_var_screeninfo    vinfo;
+    struct fb_var_screeninfo    orig_vinfo;
     struct fb_fix_screeninfo    finfo;
     FBSurface                   surface;
 };
 
 struct FBContext fb_context;
 
+static FBSurface *frame_buffer_init(int fd, struct fb_var_screeninfo vinfo,
+                                    struct fb_fix_screeninfo finfo);
+
 FBSurface *frame_buffer_get_default()
 {
     struct fb_var_screeninfo vinfo;
     struct fb_fix_screeninfo finfo;
-    char *buffer;
 
     if (fb_context.fd)
         return &fb_context.surface;
@@ -49,27 +68,137 @@ FBSurface *frame_buffer_get_default()
         return NULL;
     }
 
-    int screen_size = vinfo.xres * vinfo.yres * vinfo.bits_per_pixel / 8;
+    fb_context.orig_vinfo = vinfo;
+
+    /* ask for a second page below the visible one to render into */
+    if (vinfo.yres_virtual < vinfo.yres * FB_PAGES_MAX)
+    {
+        struct fb_var_screeninfo request = vinfo;
+
+        request.yres_virtual = vinfo.yres * FB_PAGES_MAX;
+        request.yoffset = 0;
+
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &request) == 0)
+        {
+            ioctl(fd, FBIOGET_VSCREENINFO, &vinfo);
+            ioctl(fd, FBIOGET_FSCREENINFO, &finfo);
+        }
+    }
+
+    return frame_buffer_init(fd, vinfo, finfo);
+}
+
+FBSurface *frame_buffer_get_memory(const struct fb_var_screeninfo *mode)
+{
+    struct fb_var_screeninfo vinfo = *mode;
+    struct fb_fix_screeninfo finfo;
+
+    if (fb_context.fd)
+        return &fb_context.surface;
+
+    memset(&finfo, 0, sizeof(finfo));
+    vinfo.xres_virtual = vinfo.xres;
+    vinfo.yres_virtual = vinfo.yres * FB_PAGES_MAX;
+    vinfo.xoffset = 0;
+    vinfo.yoffset = 0;
+    finfo.line_length = vinfo.xres * vinfo.bits_per_pixel / 8;
+    finfo.smem_len = finfo.line_length * vinfo.yres_virtual;
+
+    int fd = syscall(__NR_memfd_create, "framebuffer", 0);
+
+    if (fd < 0 || ftruncate(fd, finfo.smem_len) < 0)
+    {
+        perror("memfd framebuffer");
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    fb_context.orig_vinfo = vinfo;
+    fb_context.memory = 1;
+
+    return frame_buffer_init(fd, vinfo, finfo);
+}
+
+static FBSurface *frame_buffer_init(int fd, struct fb_var_screeninfo vinfo,
+                                    struct fb_fix_screeninfo finfo)
+{
+    char *buffer;
+
+    if (finfo.line_length == 0)
+        finfo.line_length = vinfo.xres_virtual * vinfo.bits_per_pixel / 8;
+
+    /* scanlines may be padded, and the visible area may start at a
+     * horizontal pan offset inside each of them */
+    int screen_size = finfo.line_length * vinfo.yres;
+    int page_size = finfo.line_length * vinfo.yres;
+    int origin = vinfo.xoffset * vinfo.bits_per_pixel / 8;
+    int pages = FB_PAGES_MAX;
+
+    if (vinfo.yres_virtual < vinfo.yres * FB_PAGES_MAX ||
+        finfo.smem_len < (unsigned)page_size * FB_PAGES_MAX)
+    {
+        printf("no room for a back buffer, draw to the screen directly\n");
+        pages = 1;
+    }
 
     fb_context.saved = malloc(screen_size);
-    read(fd, fb_context.saved, screen_size);
+    fb_context.row = malloc(finfo.line_length);
+    pread(fd, fb_context.saved, screen_size,
+          (off_t)fb_context.orig_vinfo.yoffset * finfo.line_length);
+
+    buffer = (char *)mmap(0, page_size * pages, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (buffer == MAP_FAILED)
+    {
+        perror("mmap "FRAMEBUFFER_DEV_NAME);
+        free(fb_context.saved);
+        free(fb_context.row);
+        close(fd);
+        memset(&fb_context, 0, sizeof(fb_context));
+        return NULL;
+    }
 
-    buffer = (char *)mmap(0, screen_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    memset(buffer, 0, screen_size);
+    memset(buffer, 0, page_size * pages);
 
     fb_context.fd = fd;
     fb_context.finfo = finfo;
     fb_context.vinfo = vinfo;
     fb_context.buffer = buffer;
     fb_context.screen_size = screen_size;
+    fb_context.page_size = page_size;
+    fb_context.origin = origin;
+    fb_context.map_size = page_size * pages;
+    fb_context.vsync = !fb_context.memory;
 
     fb_context.surface.width  = vinfo.xres;
     fb_context.surface.height = vinfo.yres;
     fb_context.surface.depth  = vinfo.bits_per_pixel / 8;
-    fb_context.surface.buffer = buffer;
+    fb_context.surface.stride = finfo.line_length;
     fb_context.surface.size   = screen_size;
+    fb_context.surface.pages  = pages;
+
+    /* show the first page, start drawing into the last one */
+    if (!fb_context.memory && (pages > 1 || vinfo.yoffset != 0))
+    {
+        fb_context.vinfo.yoffset = 0;
+        ioctl(fd, FBIOPAN_DISPLAY, &fb_context.vinfo);
+    }
+
+    fb_context.surface.page   = pages - 1;
+    fb_context.surface.buffer = buffer + page_size * fb_context.surface.page + origin;
+
+    if (pixel_format_init(&fb_context.surface.format, &vinfo) < 0)
+    {
+        frame_buffer_close();
+        return NULL;
+    }
 
-    printf("Mode: %dx%d %dbpp\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel);
+    printf("Mode: %dx%d %dbpp, %d pages, rgba %d/%d %d/%d %d/%d %d/%d, kernel %s\n",
+            vinfo.xres, vinfo.yres, vinfo.bits_per_pixel, pages,
+            vinfo.red.offset, vinfo.red.length, vinfo.green.offset, vinfo.green.length,
+            vinfo.blue.offset, vinfo.blue.length, vinfo.transp.offset, vinfo.transp.length,
+            pixel_get_kernel_name());
 
     return &fb_context.surface;
 }
@@ -98,19 +227,251 @@ int frame_buffer_get_finfo(struct fb_fix_screeninfo *finfo)
     return 1;
 }
 
+/* framebuffer memory is mapped write combined: reading it back is very slow
+ * and every store that misses a full combining line costs a bus cycle, so
+ * rows are written with streaming stores that bypass the caches */
+static void fb_copy_row(char *dst, const char *src, int bytes)
+{
+#if defined(__SSE2__)
+    int head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if (bytes < 64)
+    {
+        memcpy(dst, src, bytes);
+        return;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    bytes -= head;
+
+    for (; bytes >= 64; bytes -= 64, dst += 64, src += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+
+    memcpy(dst, src, bytes);
+#elif defined(__aarch64__)
+    for (; bytes >= 64; bytes -= 64, dst += 64, src += 64)
+    {
+        uint8x16_t a = vld1q_u8((const uint8_t *)src);
+        uint8x16_t b = vld1q_u8((const uint8_t *)(src + 16));
+        uint8x16_t c = vld1q_u8((const uint8_t *)(src + 32));
+        uint8x16_t d = vld1q_u8((const uint8_t *)(src + 48));
+
+        __asm__ volatile("stnp %q0, %q1, [%2]\n\t"
+                         "stnp %q3, %q4, [%2, #32]"
+                         :: "w"(a), "w"(b), "r"(dst), "w"(c), "w"(d) : "memory");
+    }
+
+    memcpy(dst, src, bytes);
+#elif defined(__ARM_NEON__)
+    /* armv7 has no non-temporal store; aligned 64 byte bursts at least let
+     * the write buffer merge each into whole bus transactions, where memcpy
+     * may leave partial ones around its own alignment */
+    int head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if (bytes < 64)
+    {
+        memcpy(dst, src, bytes);
+        return;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    bytes -= head;
+
+    for (; bytes >= 64; bytes -= 64, dst += 64, src += 64)
+    {
+        uint8x16_t a = vld1q_u8((const uint8_t *)src);
+        uint8x16_t b = vld1q_u8((const uint8_t *)(src + 16));
+        uint8x16_t c = vld1q_u8((const uint8_t *)(src + 32));
+        uint8x16_t d = vld1q_u8((const uint8_t *)(src + 48));
+
+        vst1q_u8((uint8_t *)dst, a);
+        vst1q_u8((uint8_t *)(dst + 16), b);
+        vst1q_u8((uint8_t *)(dst + 32), c);
+        vst1q_u8((uint8_t *)(dst + 48), d);
+    }
+
+    memcpy(dst, src, bytes);
+#else
+    memcpy(dst, src, bytes);
+#endif
+}
+
+static void fb_copy_done()
+{
+#if defined(__SSE2__)
+    /* streaming stores are weakly ordered, drain them before a flip */
+    _mm_sfence();
+#endif
+}
+
+void frame_buffer_blit(FBSurface *surf, int x, int y, int w, int h,
+                       const char *src, int pitch)
+{
+    int bytes = w * surf->depth;
+    char *dst;
+
+    if (fb_context.blanked || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+        x + w > surf->width || y + h > surf->height)
+    {
+        return;
+    }
+
+    dst = surf->buffer + y * surf->stride + x * surf->depth;
+    surf->written += (uint64_t)bytes * h;
+
+    if (bytes == pitch && bytes == surf->stride)
+    {
+        fb_copy_row(dst, src, bytes * h);
+        fb_copy_done();
+        return;
+    }
+
+    while (h--)
+    {
+        fb_copy_row(dst, src, bytes);
+        dst += surf->stride;
+        src += pitch;
+    }
+
+    fb_copy_done();
+}
+
+void frame_buffer_blit_lut(FBSurface *surf, int x, int y, int w, int h,
+                           const uint8_t *src, int pitch, const uint32_t *lut)
+{
+    PixelExpandFunc expand = pixel_get_expander(surf->depth);
+    int bytes = w * surf->depth;
+    char *dst;
+
+    if (fb_context.blanked || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+        x + w > surf->width || y + h > surf->height || expand == NULL)
+    {
+        return;
+    }
+
+    dst = surf->buffer + y * surf->stride + x * surf->depth;
+    surf->written += (uint64_t)bytes * h;
+
+    if (fb_context.row == NULL)
+    {
+        expand(dst, surf->stride, src, pitch, w, h, lut);
+        return;
+    }
+
+    /* the kernels store unaligned and in pieces, let them write to the
+     * cache and send each finished row out with streaming stores */
+    while (h--)
+    {
+        expand(fb_context.row, bytes, src, pitch, w, 1, lut);
+        fb_copy_row(dst, fb_context.row, bytes);
+        dst += surf->stride;
+        src += pitch;
+    }
+
+    fb_copy_done();
+}
+
+int frame_buffer_flip()
+{
+    FBSurface *surf = &fb_context.surface;
+    int crtc = 0;
+
+    if (!fb_context.fd || surf->pages < 2 || fb_context.blanked)
+    {
+        return 0;
+    }
+
+    fb_context.vinfo.yoffset = surf->page * fb_context.vinfo.yres;
+
+    if (!fb_context.memory && ioctl(fb_context.fd, FBIOPAN_DISPLAY, &fb_context.vinfo) < 0)
+    {
+        /* the driver refuses to pan, keep drawing into the visible page */
+        perror("ioctl FBIOPAN_DISPLAY");
+        surf->pages = 1;
+        surf->page = 0;
+        surf->buffer = fb_context.buffer + fb_context.origin;
+        return -1;
+    }
+
+    /* the old front page is still scanned out until the next vblank */
+    if (fb_context.vsync && ioctl(fb_context.fd, FBIO_WAITFORVSYNC, &crtc) < 0)
+    {
+        fb_context.vsync = 0;
+    }
+
+    surf->page = (surf->page + 1) % surf->pages;
+    surf->buffer = fb_context.buffer + fb_context.page_size * surf->page + fb_context.origin;
+
+    return 0;
+}
+
+int frame_buffer_blank(int blank)
+{
+    if (!fb_context.fd)
+        return -1;
+
+    if (fb_context.blanked == blank)
+        return 0;
+
+    fb_context.blanked = blank;
+
+    if (!fb_context.memory &&
+        ioctl(fb_context.fd, FBIOBLANK, blank ? FB_BLANK_POWERDOWN : FB_BLANK_UNBLANK) < 0)
+    {
+        perror("ioctl FBIOBLANK");
+        return -1;
+    }
+
+    return 0;
+}
+
+int frame_buffer_blanked()
+{
+    return fb_context.blanked;
+}
+
 void frame_buffer_close()
 {
+    struct fb_var_screeninfo *orig = &fb_context.orig_vinfo;
+
     if (!fb_context.fd)
     {
         return;
     }
 
-    memcpy(fb_context.buffer, fb_context.saved, fb_context.screen_size);
+    pwrite(fb_context.fd, fb_context.saved, fb_context.screen_size,
+           (off_t)orig->yoffset * fb_context.finfo.line_length);
 
-    munmap(fb_context.buffer, fb_context.screen_size);
+    if (!fb_context.memory)
+    {
+        /* whatever boots next expects a lit panel */
+        if (fb_context.blanked)
+            ioctl(fb_context.fd, FBIOBLANK, FB_BLANK_UNBLANK);
+
+        if (orig->yres_virtual != fb_context.vinfo.yres_virtual)
+            ioctl(fb_context.fd, FBIOPUT_VSCREENINFO, orig);
+        else if (orig->yoffset != fb_context.vinfo.yoffset)
+            ioctl(fb_context.fd, FBIOPAN_DISPLAY, orig);
+    }
+
+    munmap(fb_context.buffer, fb_context.map_size);
     close(fb_context.fd);
     free(fb_context.saved);
+    free(fb_context.row);
 
     memset(&fb_context, 0, sizeof(fb_context));
 }
-
@@ -1,9 +1,11 @@
 
-#include <linux/fb.h>
+#include "pixel.h"
 
 #ifndef _FT_FRAME_BUFFER_H_
 #define _FT_FRAME_BUFFER_H_
 
+#define FB_PAGES_MAX    2
+
 typedef struct _FBSurface FBSurface;
 
 struct _FBSurface
@@ -11,16 +13,42 @@ struct _FBSurface
     int     width;
     int     height;
     int     depth;
+    int     stride;     /* bytes between two scanlines */
     int     size;
-    char   *buffer;
+    char   *buffer;     /* page being drawn, shown by frame_buffer_flip() */
+    int     page;
+    int     pages;
+
+    uint64_t written;   /* bytes stored into the framebuffer so far */
+
+    PixelFormat format;
 };
 
 FBSurface *frame_buffer_get_default();
 
+/* a framebuffer in anonymous memory with the given mode, for host runs */
+FBSurface *frame_buffer_get_memory(const struct fb_var_screeninfo *mode);
+
 int frame_buffer_get_vinfo(struct fb_var_screeninfo *vinfo);
 
 int frame_buffer_get_finfo(struct fb_fix_screeninfo *finfo);
 
+void frame_buffer_blit(FBSurface *surf, int x, int y, int w, int h,
+                       const char *src, int pitch);
+
+void frame_buffer_blit_lut(FBSurface *surf, int x, int y, int w, int h,
+                           const uint8_t *src, int pitch, const uint32_t *lut);
+
+/* returns -1 when paging broke down and the screen must be repainted */
+int frame_buffer_flip();
+
+/* powers the panel down or up; while blanked, blits and flips do nothing and
+ * the screen has to be repainted after unblanking. -1 when the driver
+ * refuses, the blits stop all the same */
+int frame_buffer_blank(int blank);
+
+int frame_buffer_blanked();
+
 void frame_buffer_close();
 
 #endif/*_FT_FRAME_BUFFER_H_*/
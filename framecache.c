@@ -0,0 +1,300 @@
+#include "framecache.h"
+#include "framebuffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define FRAME_CACHE_MAGIC   0x43474843  /* "CHGC" */
+#define FRAME_CACHE_VERSION 4
+#define FRAME_CACHE_ALIGN   4096
+
+typedef struct _FrameCacheHeader FrameCacheHeader;
+
+struct _FrameCacheHeader
+{
+    uint32_t        magic;
+    uint32_t        version;
+    FrameCacheKey   key;
+    uint32_t        w, h, size, count;
+    uint32_t        mode, depth, lut_count;
+    uint32_t        rects_offset;
+    uint32_t        luts_offset;
+    uint32_t        frame_luts_offset;
+    uint32_t        delays_offset;
+    uint32_t        buffer_offset;
+    uint32_t        file_size;
+};
+
+static uint32_t align_up(uint32_t value, uint32_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len > 0)
+    {
+        ssize_t size = write(fd, p, len);
+
+        if (size <= 0)
+            return -1;
+
+        p += size;
+        len -= size;
+    }
+
+    return 0;
+}
+
+/* the tables come from disk, nothing in them may point outside the frames */
+static int frame_cache_check(const FrameCacheHeader *hdr, const char *map)
+{
+    const GifRect *rects = (const GifRect *)(map + hdr->rects_offset);
+    const int *frame_luts = (const int *)(map + hdr->frame_luts_offset);
+    uint32_t i;
+
+    /* indexed frames fall back to panel pixels, never the other way round */
+    if (hdr->mode != GIF_MODE_RGB &&
+        (hdr->mode != GIF_MODE_INDEXED || hdr->key.mode != GIF_MODE_INDEXED))
+        return -1;
+
+    if (hdr->depth != (hdr->mode == GIF_MODE_INDEXED ? 1 : hdr->key.bpp / 8))
+        return -1;
+
+    if (hdr->w == 0 || hdr->h == 0 ||
+        (uint64_t)hdr->w * hdr->h * hdr->depth > hdr->size)
+        return -1;
+
+    for (i = 0; i < hdr->count; i++)
+    {
+        const GifRect *r = &rects[i];
+
+        if (r->x < 0 || r->y < 0 || r->w < 0 || r->h < 0 ||
+            (uint32_t)r->x + r->w > hdr->w || (uint32_t)r->y + r->h > hdr->h)
+            return -1;
+
+        if (hdr->mode == GIF_MODE_INDEXED &&
+            (frame_luts[i] < 0 || (uint32_t)frame_luts[i] >= hdr->lut_count))
+            return -1;
+    }
+
+    return 0;
+}
+
+int frame_cache_init_key(FrameCacheKey *key, const char *fname, int mode)
+{
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+    struct stat st;
+
+    /* zero the padding too, keys are compared with memcmp */
+    memset(key, 0, sizeof(FrameCacheKey));
+
+    if (stat(fname, &st) < 0)
+    {
+        perror(fname);
+        return -1;
+    }
+
+    if (!frame_buffer_get_vinfo(&vinfo) || !frame_buffer_get_finfo(&finfo))
+    {
+        return -1;
+    }
+
+    key->gif_size    = st.st_size;
+    key->gif_mtime   = st.st_mtime;
+    key->xres        = vinfo.xres;
+    key->yres        = vinfo.yres;
+    key->bpp         = vinfo.bits_per_pixel;
+    key->line_length = finfo.line_length;
+    key->red         = vinfo.red.offset << 8 | vinfo.red.length;
+    key->green       = vinfo.green.offset << 8 | vinfo.green.length;
+    key->blue        = vinfo.blue.offset << 8 | vinfo.blue.length;
+    key->transp      = vinfo.transp.offset << 8 | vinfo.transp.length;
+    key->mode        = mode;
+
+    return 0;
+}
+
+GifImages *frame_cache_load(const char *path, const FrameCacheKey *key)
+{
+    const FrameCacheHeader *hdr;
+    GifImages *imgs;
+    struct stat st;
+    char *map;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(FrameCacheHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        perror("mmap frame cache");
+        return NULL;
+    }
+
+    hdr = (const FrameCacheHeader *)map;
+
+    if (hdr->magic != FRAME_CACHE_MAGIC ||
+        hdr->version != FRAME_CACHE_VERSION ||
+        hdr->file_size != st.st_size ||
+        memcmp(&hdr->key, key, sizeof(FrameCacheKey)) != 0 ||
+        hdr->count == 0 ||
+        (uint64_t)hdr->buffer_offset + (uint64_t)hdr->size * hdr->count > (uint64_t)st.st_size ||
+        hdr->rects_offset + (uint64_t)sizeof(GifRect) * hdr->count > hdr->buffer_offset ||
+        hdr->luts_offset + (uint64_t)sizeof(uint32_t) * GIF_COLOR_TABLE_MAX * hdr->lut_count > hdr->buffer_offset ||
+        hdr->frame_luts_offset + (uint64_t)sizeof(int) * hdr->count > hdr->buffer_offset ||
+        hdr->delays_offset + (uint64_t)sizeof(int) * hdr->count > hdr->buffer_offset)
+    {
+        printf("frame cache %s is stale\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    /* a damaged file would only be mapped again on the next boot */
+    if (frame_cache_check(hdr, map) < 0)
+    {
+        printf("frame cache %s is corrupt\n", path);
+        munmap(map, st.st_size);
+        unlink(path);
+        return NULL;
+    }
+
+    imgs = calloc(1, sizeof(GifImages));
+    imgs->w          = hdr->w;
+    imgs->h          = hdr->h;
+    imgs->size       = hdr->size;
+    imgs->count      = hdr->count;
+    imgs->mode       = hdr->mode;
+    imgs->depth      = hdr->depth;
+    imgs->lut_count  = hdr->lut_count;
+    imgs->rects      = (GifRect *)(map + hdr->rects_offset);
+    imgs->luts       = (uint32_t *)(map + hdr->luts_offset);
+    imgs->frame_luts = (int *)(map + hdr->frame_luts_offset);
+    imgs->delays     = (int *)(map + hdr->delays_offset);
+    imgs->buffer     = map + hdr->buffer_offset;
+    imgs->map        = map;
+    imgs->map_size   = st.st_size;
+
+    /* the first frame is needed right away, start reading it in */
+    madvise(imgs->buffer, imgs->size, MADV_WILLNEED);
+
+    return imgs;
+}
+
+int frame_cache_store(const char *path, const FrameCacheKey *key, GifImages *imgs)
+{
+    FrameCacheHeader hdr;
+    const char *frame;
+    int i;
+    char temp[PATH_MAX];
+    char pad[FRAME_CACHE_ALIGN] = {0};
+    uint32_t offset;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic     = FRAME_CACHE_MAGIC;
+    hdr.version   = FRAME_CACHE_VERSION;
+    hdr.key       = *key;
+    hdr.w         = imgs->w;
+    hdr.h         = imgs->h;
+    hdr.size      = imgs->size;
+    hdr.count     = imgs->count;
+    hdr.mode      = imgs->mode;
+    hdr.depth     = imgs->depth;
+    hdr.lut_count = imgs->lut_count;
+
+    offset = sizeof(hdr);
+    hdr.rects_offset = offset;
+    offset += sizeof(GifRect) * imgs->count;
+    hdr.frame_luts_offset = offset;
+    offset += sizeof(int) * imgs->count;
+    hdr.delays_offset = offset;
+    offset += sizeof(int) * imgs->count;
+    hdr.luts_offset = offset;
+    offset += sizeof(uint32_t) * GIF_COLOR_TABLE_MAX * imgs->lut_count;
+
+    /* page align the frames so each one maps onto whole pages */
+    hdr.buffer_offset = align_up(offset, FRAME_CACHE_ALIGN);
+    hdr.file_size = hdr.buffer_offset + imgs->size * imgs->count;
+
+    snprintf(temp, sizeof(temp), "%s", path);
+
+    if (strrchr(temp, '/'))
+    {
+        *strrchr(temp, '/') = '\0';
+        mkdir(temp, 0755);
+    }
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        perror(temp);
+        return -1;
+    }
+
+    /* frames may only be decoded now, one ring slot at a time; that also
+     * narrows their rects, so the tables are written after them */
+    if (lseek(fd, hdr.buffer_offset, SEEK_SET) < 0)
+        goto FAIL;
+
+    for (i = 0; i < imgs->count; i++)
+    {
+        frame = gif_get_frame(imgs, i);
+
+        if (frame == NULL || write_all(fd, frame, imgs->size) < 0)
+            goto FAIL;
+    }
+
+    if (lseek(fd, 0, SEEK_SET) < 0 ||
+        write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+        write_all(fd, imgs->rects, sizeof(GifRect) * imgs->count) < 0 ||
+        write_all(fd, imgs->frame_luts, sizeof(int) * imgs->count) < 0 ||
+        write_all(fd, imgs->delays, sizeof(int) * imgs->count) < 0 ||
+        write_all(fd, imgs->luts, sizeof(uint32_t) * GIF_COLOR_TABLE_MAX * imgs->lut_count) < 0 ||
+        write_all(fd, pad, hdr.buffer_offset - offset) < 0)
+    {
+        goto FAIL;
+    }
+
+    if (fsync(fd) < 0)
+        goto FAIL;
+
+    close(fd);
+
+    /* readers only ever see a complete cache */
+    if (rename(temp, path) < 0)
+    {
+        perror(path);
+        unlink(temp);
+        return -1;
+    }
+
+    return 0;
+
+FAIL:
+    perror(temp);
+    close(fd);
+    unlink(temp);
+    return -1;
+}
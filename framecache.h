@@ -0,0 +1,26 @@
+#include "gifdecode.h"
+
+#ifndef _FRAME_CACHE_H_
+#define _FRAME_CACHE_H_
+
+typedef struct _FrameCacheKey FrameCacheKey;
+
+struct _FrameCacheKey
+{
+    uint64_t    gif_size;
+    uint64_t    gif_mtime;
+    uint32_t    xres, yres;
+    uint32_t    bpp, line_length;
+    uint32_t    red, green, blue, transp;   /* offset << 8 | length */
+    uint32_t    mode;
+    uint32_t    filter;
+};
+
+int frame_cache_init_key(FrameCacheKey *key, const char *fname, int mode);
+
+GifImages *frame_cache_load(const char *path, const FrameCacheKey *key);
+
+/* decodes every frame of imgs that is not in memory yet */
+int frame_cache_store(const char *path, const FrameCacheKey *key, GifImages *imgs);
+
+#endif/*_FRAME_CACHE_H_*/
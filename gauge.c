@@ -0,0 +1,223 @@
+#include "gauge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t gauge_pixel(const Gauge *gauge, const char *frame, const uint32_t *lut, int x, int y)
+{
+    if (gauge->mode == GIF_MODE_INDEXED)
+        return lut[(uint8_t)frame[y * gauge->w + x]];
+
+    return pixel_load(frame + (y * gauge->w + x) * gauge->depth, gauge->depth);
+}
+
+static int gauge_distance(const PixelFormat *fmt, uint32_t a, uint32_t b)
+{
+    int r0, g0, b0, r1, g1, b1, d;
+
+    pixel_unpack(fmt, a, &r0, &g0, &b0);
+    pixel_unpack(fmt, b, &r1, &g1, &b1);
+
+    d = abs(r0 - r1);
+    d = abs(g0 - g1) > d ? abs(g0 - g1) : d;
+
+    return abs(b0 - b1) > d ? abs(b0 - b1) : d;
+}
+
+/* the bounding box of every changed pixel, all of it is redrawn, and the
+ * rows the fill spans: clearly changed in at least half as many pixels as
+ * the widest row, so a faint glow or dithering does not stretch the level */
+static int gauge_measure(Gauge *gauge, const PixelFormat *fmt,
+                         const char *empty, const uint32_t *empty_lut,
+                         const char *full, const uint32_t *full_lut)
+{
+    int *rows = calloc(gauge->h, sizeof(int));
+    int x, y, widest = 0;
+    int x0 = gauge->w, y0 = gauge->h, x1 = -1, y1 = -1;
+
+    if (rows == NULL)
+        return -1;
+
+    for (y = 0; y < gauge->h; y++)
+    {
+        for (x = 0; x < gauge->w; x++)
+        {
+            uint32_t a = gauge_pixel(gauge, empty, empty_lut, x, y);
+            uint32_t b = gauge_pixel(gauge, full, full_lut, x, y);
+
+            if (a == b)
+                continue;
+
+            if (gauge_distance(fmt, a, b) >= GAUGE_THRESHOLD)
+                rows[y]++;
+
+            x0 = x < x0 ? x : x0;
+            x1 = x > x1 ? x : x1;
+            y0 = y < y0 ? y : y0;
+            y1 = y;
+        }
+
+        widest = rows[y] > widest ? rows[y] : widest;
+    }
+
+    if (widest == 0)
+    {
+        free(rows);
+        return -1;
+    }
+
+    gauge->rect.x = x0;
+    gauge->rect.y = y0;
+    gauge->rect.w = x1 - x0 + 1;
+    gauge->rect.h = y1 - y0 + 1;
+
+    for (gauge->top = y0; rows[gauge->top] * 2 < widest; gauge->top++);
+    for (gauge->bottom = y1 + 1; rows[gauge->bottom - 1] * 2 < widest; gauge->bottom--);
+
+    free(rows);
+
+    return 0;
+}
+
+int gauge_init(Gauge *gauge, GifImages *imgs, const PixelFormat *fmt)
+{
+    int pitch = imgs->w * imgs->depth;
+    const char *empty, *full;
+    char *copy;
+    int y;
+
+    memset(gauge, 0, sizeof(*gauge));
+
+    if (imgs->count < 2)
+        return -1;
+
+    gauge->w = imgs->w;
+    gauge->h = imgs->h;
+    gauge->mode = imgs->mode;
+    gauge->depth = imgs->depth;
+
+    if (imgs->mode == GIF_MODE_INDEXED)
+    {
+        memcpy(gauge->background_lut, gif_get_lut(imgs, 0), sizeof(gauge->background_lut));
+        memcpy(gauge->fill_lut, gif_get_lut(imgs, imgs->count - 1), sizeof(gauge->fill_lut));
+    }
+
+    /* the ring may hold a single frame, keep the first before asking for the last */
+    empty = gif_get_frame(imgs, 0);
+    gauge->background = malloc(imgs->size);
+
+    if (empty == NULL || gauge->background == NULL)
+        goto FAIL;
+
+    memcpy(gauge->background, empty, imgs->size);
+
+    full = gif_get_frame(imgs, imgs->count - 1);
+
+    if (full == NULL ||
+        gauge_measure(gauge, fmt, gauge->background, gauge->background_lut, full, gauge->fill_lut) < 0)
+        goto FAIL;
+
+    gauge->fill = malloc(gauge->rect.w * gauge->rect.h * gauge->depth);
+
+    if (gauge->fill == NULL)
+        goto FAIL;
+
+    copy = gauge->fill;
+
+    for (y = gauge->rect.y; y < gauge->rect.y + gauge->rect.h; y++)
+    {
+        memcpy(copy, full + y * pitch + gauge->rect.x * gauge->depth, gauge->rect.w * gauge->depth);
+        copy += gauge->rect.w * gauge->depth;
+    }
+
+    printf("Gauge: %dx%d at %d,%d, level rows %d-%d\n", gauge->rect.w, gauge->rect.h,
+            gauge->rect.x, gauge->rect.y, gauge->top, gauge->bottom);
+
+    return 0;
+
+FAIL:
+    gauge_free(gauge);
+    return -1;
+}
+
+static void gauge_blit(const Gauge *gauge, FBSurface *surf, int x, int y,
+                       const char *src, int pitch, const uint32_t *lut, int w, int h)
+{
+    if (gauge->mode == GIF_MODE_INDEXED)
+        frame_buffer_blit_lut(surf, x, y, w, h, (const uint8_t *)src, pitch, lut);
+    else
+        frame_buffer_blit(surf, x, y, w, h, src, pitch);
+}
+
+/* first row of the rect showing the fill */
+static int gauge_level_row(const Gauge *gauge, int percent)
+{
+    if (percent < 0)
+        percent = 0;
+
+    if (percent > 100)
+        percent = 100;
+
+    return gauge->bottom - (gauge->bottom - gauge->top) * percent / 100;
+}
+
+void gauge_draw(const Gauge *gauge, FBSurface *surf, int x, int y, int from, int percent)
+{
+    const GifRect *rect = &gauge->rect;
+    int pitch = gauge->w * gauge->depth;
+    int fill_pitch = rect->w * gauge->depth;
+    int level = gauge_level_row(gauge, percent);
+    int start, end;
+
+    if (from < 0)
+    {
+        gauge_blit(gauge, surf, x, y, gauge->background, pitch, gauge->background_lut,
+                   gauge->w, gauge->h);
+        start = level;
+        end = rect->y + rect->h;
+    }
+    else
+    {
+        /* only the rows between the two levels change */
+        start = gauge_level_row(gauge, from);
+        end = level;
+
+        if (start > end)
+        {
+            start = level;
+            end = gauge_level_row(gauge, from);
+        }
+    }
+
+    if (start < rect->y)
+        start = rect->y;
+
+    if (end > rect->y + rect->h)
+        end = rect->y + rect->h;
+
+    if (from >= 0 && start < level && start < end)
+    {
+        /* emptier than before, the background comes back */
+        gauge_blit(gauge, surf, x + rect->x, y + start,
+                   gauge->background + start * pitch + rect->x * gauge->depth, pitch,
+                   gauge->background_lut, rect->w, (end < level ? end : level) - start);
+    }
+
+    if (end > level)
+    {
+        start = start > level ? start : level;
+
+        gauge_blit(gauge, surf, x + rect->x, y + start,
+                   gauge->fill + (start - rect->y) * fill_pitch, fill_pitch,
+                   gauge->fill_lut, rect->w, end - start);
+    }
+}
+
+void gauge_free(Gauge *gauge)
+{
+    free(gauge->background);
+    free(gauge->fill);
+    gauge->background = NULL;
+    gauge->fill = NULL;
+}
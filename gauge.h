@@ -0,0 +1,36 @@
+#include "gifdecode.h"
+#include "framebuffer.h"
+
+#ifndef _GAUGE_H_
+#define _GAUGE_H_
+
+#define GAUGE_THRESHOLD 32      /* channel difference telling the fill from the empty gauge */
+
+typedef struct _Gauge Gauge;
+
+/* the battery drawn for any capacity from two layers taken out of the
+ * animation: its first frame as the background and the fill of its last
+ * frame, cropped to where the two differ */
+struct _Gauge
+{
+    int         w, h;           /* of the background */
+    int         mode, depth;    /* as the frames they come from */
+    char       *background;
+    char       *fill;           /* rect.w x rect.h */
+    uint32_t    background_lut[GIF_COLOR_TABLE_MAX];
+    uint32_t    fill_lut[GIF_COLOR_TABLE_MAX];
+    GifRect     rect;           /* everything that differs, the only area redrawn */
+    int         top, bottom;    /* rows the fill level moves between */
+};
+
+/* copy the layers out of imgs, frames in the pixel format fmt, which may be
+ * freed afterwards; -1 when the first and last frames do not differ */
+int gauge_init(Gauge *gauge, GifImages *imgs, const PixelFormat *fmt);
+
+/* draw percent into surf at x, y over what from left there, -1 when the
+ * surface holds nothing of the gauge yet and it is drawn in full */
+void gauge_draw(const Gauge *gauge, FBSurface *surf, int x, int y, int from, int percent);
+
+void gauge_free(Gauge *gauge);
+
+#endif/*_GAUGE_H_*/
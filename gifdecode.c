@@ -2,234 +2,933 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
-#define FB_COLOR_DEPTH  16
-#define FB_MAKE_COLOR_16(r, g, b) \
-    (((r) >> 3) << 11 | ((g) >> 2) << 5 | ((b) >> 3))
-
-#define GIF_COLOR_TABLE_MAX 256
-#define GIF_CHECK_RETURN(cond) \
+#define GIF_CHECK(cond) \
     if (!(cond)) \
     { \
-        PrintGifError(); \
-        return NULL; \
+        printf("gif: corrupt file, %s\n", #cond); \
+        return -1; \
     }
 
-struct GColor
+#define GIF_EXTENSION       0x21
+#define GIF_IMAGE           0x2C
+#define GIF_TRAILER         0x3B
+#define GIF_CONTROL         0xF9    /* graphics control extension label */
+
+#define LZW_BITS_MAX        12
+#define LZW_TABLE_SIZE      (1 << LZW_BITS_MAX)
+
+enum
+{
+    GIF_DISPOSE_NONE = 1,           /* 0, unspecified, is treated the same */
+    GIF_DISPOSE_BACKGROUND = 2,
+    GIF_DISPOSE_PREVIOUS = 3,
+};
+
+typedef struct _GifFrame GifFrame;
+typedef struct _GifStream GifStream;
+
+struct _GifFrame
 {
-    char r, g, b;
+    const uint8_t  *data;       /* lzw minimum code size, then the data sub-blocks */
+    GifRect         bounds;     /* image descriptor */
+    int             interlace;
+    int             transp;     /* transparent index, -1 for none */
+    int             dispose;
 };
 
-struct GColor g_color_tab[GIF_COLOR_TABLE_MAX];
+/* decoder state behind GifImages->source */
+struct _GifStream
+{
+    const uint8_t  *map;        /* the whole file */
+    size_t          map_size;
+    GifFrame       *frames;
+    int             background; /* index of the background color */
+    int             next;       /* frame the canvas is drawn into next */
+    char           *canvas;     /* frame next - 1, the base frame next is drawn over */
+    char           *saved;      /* canvas under frame next - 1 when it is disposed to previous */
+
+    /* string table: every code is its prefix code plus one byte */
+    uint16_t        prefix[LZW_TABLE_SIZE];
+    uint16_t        length[LZW_TABLE_SIZE];
+    uint8_t         suffix[LZW_TABLE_SIZE];
+    uint8_t         first[LZW_TABLE_SIZE];
+    uint8_t         string[LZW_TABLE_SIZE];
+};
 
-static ColorMapObject* gif_find_colormap(const GifFileType* gif)
+/* Graphics Control Extension: flags, delay in 1/100 s, transparent index */
+static void gif_parse_control(const uint8_t *block, int *transp, int *delay, int *dispose)
 {
-    ColorMapObject* cmap = gif->Image.ColorMap;
+    if (block[0] != 4)
+        return;
 
-    if (cmap == NULL)
-        cmap = gif->SColorMap;
+    *transp = (block[1] & 1) ? block[4] : -1;
+    *delay = (block[2] | block[3] << 8) * 10;
+    *dispose = (block[1] >> 2) & 7;
+}
 
-    if ((unsigned)cmap->ColorCount > 256 ||
-        cmap->ColorCount != (1 << cmap->BitsPerPixel))
+static int gif_init_colortable(GifImages *imgs, const uint8_t *colors, int count,
+                               const PixelFormat *fmt)
+{
+    uint32_t lut[GIF_COLOR_TABLE_MAX] = {0};
+    int i = 0;
+
+    for (; i < count; i++)
     {
-        cmap = NULL;
+        lut[i] = pixel_make(fmt, colors[3 * i], colors[3 * i + 1], colors[3 * i + 2]);
     }
 
-    return cmap;
+    /* frames usually share the global colormap, keep a single lut then */
+    if (imgs->lut_count > 0 &&
+        memcmp(gif_get_lut(imgs, imgs->count - 1), lut, sizeof(lut)) == 0)
+    {
+        return imgs->frame_luts[imgs->count - 1];
+    }
+
+    imgs->luts = realloc(imgs->luts, sizeof(lut) * (imgs->lut_count + 1));
+    memcpy(imgs->luts + GIF_COLOR_TABLE_MAX * imgs->lut_count, lut, sizeof(lut));
+
+    return imgs->lut_count++;
 }
 
-static int gif_find_transparent(const SavedImage *image, int colorCount)
+static bool gif_remap_indices(uint8_t *dst, const uint8_t *src, int size,
+                              const uint32_t *from, const uint32_t *to)
 {
-    int i, index = -1;
+    int map[GIF_COLOR_TABLE_MAX];
+    int i, k;
 
-    for (i = 0; i < image->ExtensionBlockCount; ++i)
+    for (i = 0; i < GIF_COLOR_TABLE_MAX; i++)
     {
-        const ExtensionBlock* eb = image->ExtensionBlocks + i;
+        map[i] = -1;
 
-        if (eb->Function == 0xF9 && eb->ByteCount == 4)
+        for (k = 0; k < GIF_COLOR_TABLE_MAX; k++)
         {
-            if (eb->Bytes[0] & 1)
+            if (from[i] == to[k])
             {
-                index = (unsigned char)eb->Bytes[3];
-
-                /* check for valid index */
-                if (index >= colorCount)
-                    index = -1;
-
+                map[i] = k;
                 break;
             }
         }
     }
 
-    return index;
+    for (i = 0; i < size; i++)
+    {
+        if (map[src[i]] < 0)
+            return false;
+
+        dst[i] = map[src[i]];
+    }
+
+    return true;
 }
 
-static void gif_init_colortable(ColorMapObject *cmap)
+static void gif_rect_union(GifRect *dst, const GifRect *src)
 {
-    int i = 0;
+    int x2, y2;
+
+    if (src->w <= 0 || src->h <= 0)
+        return;
+
+    if (dst->w <= 0 || dst->h <= 0)
+    {
+        *dst = *src;
+        return;
+    }
+
+    x2 = dst->x + dst->w > src->x + src->w ? dst->x + dst->w : src->x + src->w;
+    y2 = dst->y + dst->h > src->y + src->h ? dst->y + dst->h : src->y + src->h;
+
+    dst->x = dst->x < src->x ? dst->x : src->x;
+    dst->y = dst->y < src->y ? dst->y : src->y;
+    dst->w = x2 - dst->x;
+    dst->h = y2 - dst->y;
+}
+
+static bool gif_luts_compatible(const uint32_t *from, const uint32_t *to)
+{
+    int i, k;
+
+    for (i = 0; i < GIF_COLOR_TABLE_MAX; i++)
+    {
+        for (k = 0; k < GIF_COLOR_TABLE_MAX && from[i] != to[k]; k++);
 
-    for (; i < cmap->ColorCount; i++)
+        if (k == GIF_COLOR_TABLE_MAX)
+            return false;
+    }
+
+    return true;
+}
+
+static void *gif_grow(void *array, int count, size_t item)
+{
+    /* double the capacity whenever count reaches a power of two */
+    if ((count & (count - 1)) != 0)
+        return array;
+
+    return realloc(array, item * (count ? count * 2 : 1));
+}
+
+static void gif_stream_release(void *source)
+{
+    GifStream *stream = source;
+
+    munmap((void *)stream->map, stream->map_size);
+    free(stream->frames);
+    free(stream->canvas);
+    free(stream->saved);
+    free(stream);
+}
+
+static void gif_fill_rect(GifImages *imgs, char *canvas, const GifRect *rect, uint32_t pixel)
+{
+    int i, k;
+
+    for (i = rect->y; i < rect->y + rect->h; i++)
     {
-        g_color_tab[i].r = cmap->Colors[i].Red;
-        g_color_tab[i].g = cmap->Colors[i].Green;
-        g_color_tab[i].b = cmap->Colors[i].Blue;
+        char *p = canvas + (i * imgs->w + rect->x) * imgs->depth;
+
+        for (k = 0; k < rect->w; k++, p += imgs->depth)
+        {
+            if (imgs->mode == GIF_MODE_INDEXED)
+                *p = pixel;
+            else
+                pixel_store(p, imgs->depth, pixel);
+        }
     }
 }
 
-static bool gif_add_image(GifImages *imgs, GifFileType *gif, int transp, uint8_t *pixels)
+static void gif_copy_rect(GifImages *imgs, char *dst, const char *src, const GifRect *rect,
+                          bool to_canvas)
 {
-    GifImageDesc *desc = &gif->Image;
-    int i = 0, k = 0;
+    int pitch = rect->w * imgs->depth;
+    int i;
 
-    imgs->count  = gif->ImageCount;
-    imgs->buffer = realloc(imgs->buffer, imgs->size * imgs->count);
+    for (i = 0; i < rect->h; i++)
+    {
+        char *p = dst;
+        const char *q = src;
+        int offset = ((rect->y + i) * imgs->w + rect->x) * imgs->depth;
 
-    char *p = imgs->buffer + imgs->size * (imgs->count - 1);
+        if (to_canvas)
+            p += offset, q += i * pitch;
+        else
+            p += i * pitch, q += offset;
 
-    if (imgs->count > 1)
-        memcpy(p, p - imgs->size, imgs->size);
+        memcpy(p, q, pitch);
+    }
+}
 
-    for (i = 0; i < desc->Height; i++)
+/* decode the lzw data of f straight into canvas pixels, returns the box of
+ * the pixels that changed as x1, y1, x2, y2 */
+static bool gif_decode_image(GifImages *imgs, GifStream *stream, const GifFrame *f,
+                             const uint32_t *lut, int *box)
+{
+    static const int pass_start[] = { 0, 4, 2, 1 };
+    static const int pass_step[]  = { 8, 8, 4, 2 };
+
+    const uint8_t *p = f->data;
+    const uint8_t *end = stream->map + stream->map_size;
+    const int min_size = *p++;
+    const int clear = 1 << min_size;
+    const int w = f->bounds.w, h = f->bounds.h, depth = imgs->depth;
+    const bool indexed = imgs->mode == GIF_MODE_INDEXED;
+    const bool whole = stream->next == 0;
+
+    int code_size = min_size + 1, code_mask = (1 << code_size) - 1;
+    int avail = clear + 2, prev = -1;
+    uint32_t bitbuf = 0;
+    int bits = 0, block = 0;
+    int x = 0, y = 0, pass = 0, rows = 0, i;
+    char *row = stream->canvas + (f->bounds.y * imgs->w + f->bounds.x) * depth;
+
+    if (min_size < 2 || min_size > 8)
+        return false;
+
+    /* roots of the string table, the codes above them are defined as the
+     * data is decoded and may have overwritten them in an earlier image */
+    for (i = 0; i < clear; i++)
     {
-        for (k = 0; k < desc->Width; k++)
+        stream->suffix[i] = i;
+        stream->first[i] = i;
+        stream->length[i] = 1;
+    }
+
+    while (rows < h)
+    {
+        int code, len, c;
+
+        /* codes run across the data sub-blocks */
+        while (bits < code_size)
+        {
+            if (block == 0)
+            {
+                if (p >= end)
+                    return false;
+
+                /* a truncated image keeps what was decoded */
+                if ((block = *p++) == 0)
+                    return true;
+            }
+
+            if (p >= end)
+                return false;
+
+            bitbuf |= (uint32_t)*p++ << bits;
+            bits += 8;
+            block--;
+        }
+
+        code = bitbuf & code_mask;
+        bitbuf >>= code_size;
+        bits -= code_size;
+
+        if (code == clear)
         {
-            int index = pixels[i * desc->Width + k];
+            code_size = min_size + 1;
+            code_mask = (1 << code_size) - 1;
+            avail = clear + 2;
+            prev = -1;
+            continue;
+        }
+
+        if (code == clear + 1)
+            break;
 
-            if (transp != -1 && transp == index)
+        /* walk the table backwards, the string length is known up front */
+        if (code < avail && (prev >= 0 || code < clear))
+        {
+            len = stream->length[code];
+            c = code;
+            i = len - 1;
+        }
+        else if (code == avail && prev >= 0)
+        {
+            /* the string being defined, the previous one plus its first byte */
+            len = stream->length[prev] + 1;
+            stream->string[len - 1] = stream->first[prev];
+            c = prev;
+            i = len - 2;
+        }
+        else
+        {
+            return false;
+        }
+
+        for (; i >= 0; i--)
+        {
+            stream->string[i] = stream->suffix[c];
+            c = stream->prefix[c];
+        }
+
+        if (prev >= 0 && avail < LZW_TABLE_SIZE)
+        {
+            stream->prefix[avail] = prev;
+            stream->suffix[avail] = stream->string[0];
+            stream->first[avail]  = stream->first[prev];
+            stream->length[avail] = stream->length[prev] + 1;
+
+            if (++avail > code_mask && code_size < LZW_BITS_MAX)
+            {
+                code_size++;
+                code_mask = (1 << code_size) - 1;
+            }
+        }
+
+        prev = code;
+
+        /* convert and place the pixels right away */
+        for (i = 0; i < len && rows < h; i++)
+        {
+            int index = stream->string[i];
+            char *d = row + x * depth;
+
+            if (index != f->transp)
+            {
+                bool changed;
+
+                if (indexed)
+                {
+                    changed = whole || (uint8_t)*d != index;
+                    *d = index;
+                }
+                else
+                {
+                    changed = whole || pixel_load(d, depth) != lut[index];
+                    pixel_store(d, depth, lut[index]);
+                }
+
+                if (changed)
+                {
+                    if (f->bounds.x + x < box[0]) box[0] = f->bounds.x + x;
+                    if (f->bounds.x + x > box[2]) box[2] = f->bounds.x + x;
+                    if (f->bounds.y + y < box[1]) box[1] = f->bounds.y + y;
+                    if (f->bounds.y + y > box[3]) box[3] = f->bounds.y + y;
+                }
+            }
+
+            if (++x < w)
                 continue;
 
-            int offset = ((desc->Top + i) * imgs->w + desc->Left + k) * 2;
+            x = 0;
+            rows++;
 
-            int c16 = FB_MAKE_COLOR_16(g_color_tab[index].r, 
-                                       g_color_tab[index].g,
-                                       g_color_tab[index].b);
-            p[offset] = c16 & 0xFF;
-            p[offset + 1] = c16 >> 8;
+            if (!f->interlace)
+            {
+                y++;
+            }
+            else
+            {
+                y += pass_step[pass];
+
+                while (y >= h && pass < 3)
+                    y = pass_start[++pass];
+            }
+
+            row = stream->canvas + ((f->bounds.y + y) * imgs->w + f->bounds.x) * depth;
         }
     }
 
     return true;
 }
 
-static int gif_read_callback(GifFileType* fileType, GifByteType* out, int size)
+static void gif_box_add(int *box, const GifRect *rect)
 {
-    FILE *fp = fileType->UserData;
+    if (rect->x < box[0]) box[0] = rect->x;
+    if (rect->y < box[1]) box[1] = rect->y;
+    if (rect->x + rect->w - 1 > box[2]) box[2] = rect->x + rect->w - 1;
+    if (rect->y + rect->h - 1 > box[3]) box[3] = rect->y + rect->h - 1;
+}
 
-    return fread(out, 1, size, fp);
+/* draw the next frame over the canvas */
+static int gif_stream_next(GifImages *imgs, GifStream *stream)
+{
+    int frame = stream->next;
+    const GifFrame *f = &stream->frames[frame];
+    const uint32_t *lut = gif_get_lut(imgs, frame);
+    int box[4] = { imgs->w, imgs->h, -1, -1 };
+
+    if (frame > 0)
+    {
+        const GifFrame *last = &stream->frames[frame - 1];
+
+        /* take the previous frame off first, as it asked */
+        if (last->dispose == GIF_DISPOSE_BACKGROUND)
+        {
+            gif_fill_rect(imgs, stream->canvas, &last->bounds,
+                          imgs->mode == GIF_MODE_INDEXED ? (uint32_t)stream->background :
+                          gif_get_lut(imgs, frame - 1)[stream->background]);
+            gif_box_add(box, &last->bounds);
+        }
+        else if (last->dispose == GIF_DISPOSE_PREVIOUS)
+        {
+            gif_copy_rect(imgs, stream->canvas, stream->saved, &last->bounds, true);
+            gif_box_add(box, &last->bounds);
+        }
+
+        /* carry the canvas over into the new colormap */
+        if (imgs->mode == GIF_MODE_INDEXED &&
+            imgs->frame_luts[frame - 1] != imgs->frame_luts[frame] &&
+            !gif_remap_indices((uint8_t *)stream->canvas, (uint8_t *)stream->canvas, imgs->size,
+                               gif_get_lut(imgs, frame - 1), lut))
+        {
+            return -1;
+        }
+    }
+
+    if (f->dispose == GIF_DISPOSE_PREVIOUS)
+        gif_copy_rect(imgs, stream->saved, stream->canvas, &f->bounds, false);
+
+    if (!gif_decode_image(imgs, stream, f, lut, box))
+    {
+        printf("gif: corrupt image data in frame %d\n", frame);
+        return -1;
+    }
+
+    /* the scan only knew the image bounds, narrow them down; the first
+     * frame is always painted as a whole */
+    GifRect *rect = &imgs->rects[frame];
+
+    if (frame > 0 && box[2] < 0)
+    {
+        memset(rect, 0, sizeof(GifRect));
+    }
+    else if (frame > 0)
+    {
+        rect->x = box[0];
+        rect->y = box[1];
+        rect->w = box[2] - box[0] + 1;
+        rect->h = box[3] - box[1] + 1;
+    }
+
+    stream->next++;
+
+    return 0;
 }
 
-GifImages *gif_decode(const char *fname)
+static int gif_stream_load(GifImages *imgs, int frame, char *dst)
 {
-    SavedImage temp_save;
-    temp_save.ExtensionBlocks = NULL;
-    temp_save.ExtensionBlockCount = 0;
+    GifStream *stream = imgs->source;
 
-    GifRecordType type = 0;
-    GifByteType *extra = NULL;
-    GifFileType *gif = NULL;
-    GifImages *imgs = NULL;
-    int width, height, i;
-    
-    FILE *fp = fopen(fname, "r");
+    /* the canvas only moves forward, start over for an earlier frame */
+    if (frame < stream->next - 1)
+    {
+        stream->next = 0;
+        memset(stream->canvas, 0, imgs->size);
+    }
 
-    if (!fp)
+    while (stream->next <= frame)
     {
-        perror(fname);
-        return NULL;
+        if (gif_stream_next(imgs, stream) < 0)
+            return -1;
     }
 
-    gif = DGifOpen(fp, gif_read_callback);
+    memcpy(dst, stream->canvas, imgs->size);
 
-    GIF_CHECK_RETURN(gif);
+    return 0;
+}
 
-    do {
-        GIF_CHECK_RETURN(DGifGetRecordType(gif, &type) != GIF_ERROR);
-        
-        switch (type) {
-            case IMAGE_DESC_RECORD_TYPE:
-            {
-                GIF_CHECK_RETURN(DGifGetImageDesc(gif) != GIF_ERROR);
-                GIF_CHECK_RETURN(gif->ImageCount >= 1);
+/* walk the whole file once without decoding any pixels, collecting what
+ * is needed up front: frame count, colormaps, delays and image bounds */
+static int gif_scan(GifImages *imgs, GifStream *stream, const PixelFormat *fmt)
+{
+    const uint8_t *p = stream->map;
+    const uint8_t *end = p + stream->map_size;
+    const uint8_t *global = NULL;
+    int global_count = 0, flags, saved = 0;
+    int transp = -1, delay = 0, dispose = 0;    /* from the control block of the next image */
 
-                width  = gif->SWidth;
-                height = gif->SHeight;
+    GIF_CHECK(stream->map_size >= 13 && memcmp(p, "GIF", 3) == 0);
 
-                GIF_CHECK_RETURN(width > 0 && height > 0);
+    imgs->w = p[6] | p[7] << 8;
+    imgs->h = p[8] | p[9] << 8;
+    flags = p[10];
+    stream->background = p[11];
+    p += 13;
 
-                SavedImage *image = &gif->SavedImages[gif->ImageCount-1];
-                GifImageDesc *desc = &image->ImageDesc;
-                ColorMapObject *cmap = gif_find_colormap(gif);
-            
-                printf("Index: %d, top=%3d, left=%3d, width=%3d, height=%3d\n", 
-                        gif->ImageCount, desc->Top, desc->Left, desc->Width, desc->Height);
-            
-                /* decode the colortable */
-                GIF_CHECK_RETURN(cmap);
-                gif_init_colortable(cmap);
+    GIF_CHECK(imgs->w > 0 && imgs->h > 0);
 
-                /* decode the scanlines */
-                const int transp = gif_find_transparent(&temp_save, cmap->ColorCount);
-                uint8_t *scanline = malloc(desc->Width * desc->Height);
-                uint8_t *p = scanline;
+    if (flags & 0x80)
+    {
+        global_count = 2 << (flags & 7);
+        global = p;
+        p += 3 * global_count;
+    }
 
-                GIF_CHECK_RETURN(desc->Width > 0 && desc->Height > 0);
+    /* files cut short of their trailer keep the complete frames */
+    while (p < end && *p != GIF_TRAILER)
+    {
+        switch (*p++) {
+            case GIF_IMAGE:
+            {
+                const uint8_t *colors = global;
+                int count = global_count;
+                int frame = imgs->count;
+                GifFrame f;
+
+                if (end - p < 10)
+                    goto DONE;
+
+                f.bounds.x = p[0] | p[1] << 8;
+                f.bounds.y = p[2] | p[3] << 8;
+                f.bounds.w = p[4] | p[5] << 8;
+                f.bounds.h = p[6] | p[7] << 8;
+                f.interlace = (p[8] & 0x40) != 0;
+                flags = p[8];
+                p += 9;
 
-                if (gif->Image.Interlace)
+                printf("Index: %d, top=%3d, left=%3d, width=%3d, height=%3d\n", 
+                        frame + 1, f.bounds.y, f.bounds.x, f.bounds.w, f.bounds.h);
+
+                if (flags & 0x80)
                 {
-                    /* TODO: support interlace */
-                    printf("do not support interlace now!\n");
-                    return NULL;
+                    count = 2 << (flags & 7);
+                    colors = p;
+                    p += 3 * count;
                 }
 
-                for (i = 0; i < desc->Height; i++)
+                GIF_CHECK(colors && p < end);
+                GIF_CHECK(f.bounds.w > 0 && f.bounds.h > 0 &&
+                          f.bounds.x + f.bounds.w <= imgs->w &&
+                          f.bounds.y + f.bounds.h <= imgs->h);
+
+                /* skip the compressed pixels */
+                f.data = p++;
+
+                while (p < end && *p)
+                    p += *p + 1;
+
+                if (p++ >= end)
+                    goto DONE;
+
+                /* check for valid index */
+                f.transp = transp < count ? transp : -1;
+                f.dispose = dispose;
+
+                imgs->rects = gif_grow(imgs->rects, frame, sizeof(GifRect));
+                imgs->delays = gif_grow(imgs->delays, frame, sizeof(int));
+                imgs->frame_luts = gif_grow(imgs->frame_luts, frame, sizeof(int));
+                stream->frames = gif_grow(stream->frames, frame, sizeof(GifFrame));
+
+                imgs->frame_luts[frame] = gif_init_colortable(imgs, colors, count, fmt);
+                imgs->delays[frame] = delay;
+                stream->frames[frame] = f;
+
+                /* everything the frame may change: its bounds and the area
+                 * the previous one is disposed from */
+                GifRect *rect = &imgs->rects[frame];
+
+                if (frame == 0)
+                {
+                    rect->x = 0;
+                    rect->y = 0;
+                    rect->w = imgs->w;
+                    rect->h = imgs->h;
+                }
+                else
                 {
-                    GIF_CHECK_RETURN(DGifGetLine(gif, scanline, desc->Width) != GIF_ERROR);
+                    *rect = f.bounds;
 
-                    scanline += desc->Width;
+                    if (stream->frames[frame - 1].dispose == GIF_DISPOSE_BACKGROUND ||
+                        stream->frames[frame - 1].dispose == GIF_DISPOSE_PREVIOUS)
+                    {
+                        gif_rect_union(rect, &stream->frames[frame - 1].bounds);
+                    }
                 }
 
-                if (imgs == NULL)
+                if (dispose == GIF_DISPOSE_PREVIOUS && f.bounds.w * f.bounds.h > saved)
+                    saved = f.bounds.w * f.bounds.h;
+
+                /* frames only share indices when every color carries over */
+                if (imgs->mode == GIF_MODE_INDEXED && frame > 0 &&
+                    imgs->frame_luts[frame] != imgs->frame_luts[frame - 1] &&
+                    !gif_luts_compatible(gif_get_lut(imgs, frame - 1), gif_get_lut(imgs, frame)))
                 {
-                    imgs = calloc(1, sizeof(GifImages));
-                    imgs->w = width;
-                    imgs->h = height;
-                    imgs->size = width * height * 2;  /* use 16 bits color */
+                    printf("colormaps can not share indices, decode as direct color\n");
+                    imgs->mode = GIF_MODE_RGB;
                 }
 
-                gif_add_image(imgs, gif, transp, p);
-                free(p);
+                imgs->count++;
+
+                /* a control block only applies to the image following it */
+                transp = -1;
+                delay = 0;
+                dispose = 0;
 
                 break;
             }
                 
-            case EXTENSION_RECORD_TYPE:
+            case GIF_EXTENSION:
             {
-                GIF_CHECK_RETURN(DGifGetExtension(gif, &temp_save.Function, &extra) != GIF_ERROR);
+                int label = p < end ? *p++ : 0;
 
-                while (extra)
-                {
-                    /* Create an extension block with our data */
-                    GIF_CHECK_RETURN(AddExtensionBlock(&temp_save, extra[0], &extra[1]) != GIF_ERROR);
-                    GIF_CHECK_RETURN(DGifGetExtensionNext(gif, &extra) != GIF_ERROR);
+                if (label == GIF_CONTROL && end - p >= 5)
+                    gif_parse_control(p, &transp, &delay, &dispose);
 
-                    temp_save.Function = 0;
-                }
+                while (p < end && *p)
+                    p += *p + 1;
+
+                p++;
                 break;
             }
                 
-            case TERMINATE_RECORD_TYPE:
-                break;
-                
-            default: break; /* Should be trapped by DGifGetRecordType */
+            default:
+                GIF_CHECK(!"unknown block");
         }
     }
-    while (type != TERMINATE_RECORD_TYPE);
 
 DONE:
-    DGifCloseFile(gif);
-    fclose(fp);
+    GIF_CHECK(imgs->count > 0);
+
+    imgs->depth = (imgs->mode == GIF_MODE_INDEXED) ? 1 : fmt->depth;
+    imgs->size = imgs->w * imgs->h * imgs->depth;
+
+    GIF_CHECK(stream->background < GIF_COLOR_TABLE_MAX);
+
+    stream->canvas = calloc(1, imgs->size);
+    stream->saved = saved ? malloc(saved * imgs->depth) : NULL;
+
+    return 0;
+}
+
+GifImages *gif_decode(const char *fname, int mode, const PixelFormat *fmt)
+{
+    GifImages *imgs;
+    GifStream *stream;
+    struct stat st;
+    void *map;
+
+    int fd = open(fname, O_RDONLY);
+
+    if (fd < 0)
+    {
+        perror(fname);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        perror(fname);
+        return NULL;
+    }
+
+    imgs = calloc(1, sizeof(GifImages));
+    stream = calloc(1, sizeof(GifStream));
+
+    imgs->mode = mode;
+    imgs->source = stream;
+    imgs->load = gif_stream_load;
+    imgs->release = gif_stream_release;
+    stream->map = map;
+    stream->map_size = st.st_size;
+
+    if (gif_scan(imgs, stream, fmt) < 0 || gif_set_ring(imgs, 1) < 0)
+    {
+        gif_free(imgs);
+        return NULL;
+    }
 
     return imgs;
 }
 
+int gif_set_ring(GifImages *imgs, int ring)
+{
+    int i;
+
+    if (imgs->load == NULL || imgs->worker)
+        return -1;
+
+    if (ring <= 0 || ring > imgs->count)
+        ring = imgs->count;
+
+    free(imgs->buffer);
+    free(imgs->ring_frames);
+
+    imgs->ring = ring;
+    imgs->buffer = malloc((size_t)imgs->size * ring);
+    imgs->ring_frames = malloc(sizeof(int) * ring);
+
+    if (imgs->buffer == NULL || imgs->ring_frames == NULL)
+        return -1;
+
+    for (i = 0; i < ring; i++)
+        imgs->ring_frames[i] = -1;
+
+    return 0;
+}
+
+const char *gif_get_frame(GifImages *imgs, int frame)
+{
+    int slot;
+    char *p;
+
+    if (frame < 0 || frame >= imgs->count)
+        return NULL;
+
+    /* the worker owns the decoder, only take what it has published; once
+     * it gave up the rest is decoded here like without a worker */
+    if (imgs->worker)
+    {
+        if (frame < __atomic_load_n(&imgs->ready, __ATOMIC_ACQUIRE))
+            return imgs->buffer + (size_t)imgs->size * frame;
+
+        if (!__atomic_load_n(&imgs->done, __ATOMIC_ACQUIRE))
+            return NULL;
+    }
+
+    if (imgs->ring == 0)
+        return imgs->buffer + (size_t)imgs->size * frame;
+
+    slot = frame % imgs->ring;
+    p = imgs->buffer + (size_t)imgs->size * slot;
+
+    if (imgs->ring_frames[slot] != frame)
+    {
+        imgs->ring_frames[slot] = -1;
+
+        if (imgs->load(imgs, frame, p) < 0)
+            return NULL;
+
+        imgs->ring_frames[slot] = frame;
+    }
+
+    return p;
+}
+
+static void *gif_worker_run(void *data)
+{
+    GifImages *imgs = data;
+    int i;
+
+    for (i = imgs->ready; i < imgs->count; i++)
+    {
+        char *p = imgs->buffer + (size_t)imgs->size * i;
+
+        if (__atomic_load_n(&imgs->cancel, __ATOMIC_RELAXED))
+            break;
+
+        if (imgs->ring_frames[i] != i)
+        {
+            if (imgs->load(imgs, i, p) < 0)
+                break;
+
+            imgs->ring_frames[i] = i;
+        }
+
+        /* pixels and rect of the frame are complete before it is published */
+        __atomic_store_n(&imgs->ready, i + 1, __ATOMIC_RELEASE);
+    }
+
+    /* also when stopped early, the decoder and ring_frames are free again */
+    __atomic_store_n(&imgs->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+int gif_decode_async(GifImages *imgs)
+{
+    pthread_t *worker;
+
+    if (imgs->load == NULL || imgs->worker || imgs->ring < imgs->count)
+        return -1;
+
+    /* the first frame is wanted on screen right away */
+    if (gif_get_frame(imgs, 0) == NULL)
+        return -1;
+
+    if (imgs->count == 1)
+        return 0;
+
+    worker = malloc(sizeof(pthread_t));
+    imgs->ready = 1;
+    imgs->cancel = 0;
+    imgs->done = 0;
+    imgs->worker = worker;
+
+    if (pthread_create(worker, NULL, gif_worker_run, imgs) != 0)
+    {
+        /* keep decoding on demand */
+        perror("pthread_create");
+        imgs->worker = NULL;
+        free(worker);
+        return -1;
+    }
+
+    return 0;
+}
+
+int gif_decode_pending(const GifImages *imgs)
+{
+    return imgs->worker && !__atomic_load_n(&imgs->done, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&imgs->ready, __ATOMIC_ACQUIRE) < imgs->count;
+}
+
+int gif_decode_complete(const GifImages *imgs)
+{
+    int i;
+
+    if (imgs->worker)
+        return __atomic_load_n(&imgs->ready, __ATOMIC_ACQUIRE) == imgs->count;
+
+    if (imgs->ring == 0)
+        return 1;
+
+    if (imgs->ring < imgs->count)
+        return 0;
+
+    for (i = 0; i < imgs->count; i++)
+    {
+        if (imgs->ring_frames[i] != i)
+            return 0;
+    }
+
+    return 1;
+}
+
+const uint32_t *gif_get_lut(const GifImages *imgs, int frame)
+{
+    return imgs->luts + GIF_COLOR_TABLE_MAX * imgs->frame_luts[frame];
+}
+
+int gif_get_delay(const GifImages *imgs, int frame)
+{
+    return imgs->delays ? imgs->delays[frame] : 0;
+}
+
+int gif_get_delta(const GifImages *imgs, int from, int to, GifRect *rect)
+{
+    int i;
+
+    memset(rect, 0, sizeof(GifRect));
+
+    if (from < 0 || from >= imgs->count || to < 0 || to >= imgs->count)
+    {
+        /* nothing is known about the screen, repaint everything */
+        rect->w = imgs->w;
+        rect->h = imgs->h;
+        return 1;
+    }
+
+    /* frame n differs from frame n-1 only inside rects[n], so the union of
+     * the rects between the two frames covers every changed pixel */
+    if (from > to)
+    {
+        i = from;
+        from = to;
+        to = i;
+    }
+
+    for (i = from + 1; i <= to; i++)
+    {
+        gif_rect_union(rect, &imgs->rects[i]);
+    }
+
+    return rect->w > 0 && rect->h > 0;
+}
+
+void gif_free(GifImages *imgs)
+{
+    if (imgs == NULL)
+        return;
+
+    if (imgs->map)
+    {
+        munmap(imgs->map, imgs->map_size);
+        free(imgs);
+        return;
+    }
+
+    if (imgs->worker)
+    {
+        __atomic_store_n(&imgs->cancel, 1, __ATOMIC_RELAXED);
+        pthread_join(*(pthread_t *)imgs->worker, NULL);
+        free(imgs->worker);
+    }
+
+    if (imgs->release)
+        imgs->release(imgs->source);
+
+    free(imgs->buffer);
+    free(imgs->ring_frames);
+    free(imgs->rects);
+    free(imgs->luts);
+    free(imgs->frame_luts);
+    free(imgs->delays);
+    free(imgs);
+}
+
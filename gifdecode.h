@@ -1,16 +1,83 @@
-#include "gif_lib.h"
+#include "pixel.h"
+
+#include <stdint.h>
+#include <stddef.h>
 
 #ifndef _GIFDECODE_H_
-#define _GIFDECODE_H__
+#define _GIFDECODE_H_
+
+#define GIF_COLOR_TABLE_MAX 256
+
+enum
+{
+    GIF_MODE_RGB = 0,       /* frames stored as framebuffer pixels */
+    GIF_MODE_INDEXED,       /* frames stored as palette indices plus a lut */
+};
 
+typedef struct _GifRect GifRect;
 typedef struct _GifImages GifImages;
 
+/* produce frame into dst, frames are mostly asked for in order */
+typedef int (*GifLoadFunc)(GifImages *imgs, int frame, char *dst);
+typedef void (*GifReleaseFunc)(void *source);
+
+struct _GifRect
+{
+    int     x, y, w, h;
+};
+
 struct _GifImages
 {
-    int     w, h, size, count;
-    char   *buffer;
+    int       w, h, size, count;
+    int       mode, depth;
+    char     *buffer;       /* all frames, or the ring slots when ring > 0 */
+    int       ring;
+    int      *ring_frames;  /* frame held by each ring slot, -1 when empty */
+    GifLoadFunc    load;    /* fills the ring on demand */
+    GifReleaseFunc release;
+    void     *source;       /* state of load */
+    int       ready;        /* frames published by the worker, read with acquire */
+    int       cancel;
+    int       done;         /* the worker has exited, set with release */
+    void     *worker;       /* decoding thread, NULL when frames load on demand */
+    GifRect  *rects;        /* area changed by each frame against the previous one,
+                             * may shrink once the frame has been decoded */
+    uint32_t *luts;         /* GIF_COLOR_TABLE_MAX pixels per distinct colormap */
+    int      *frame_luts;   /* lut used by each frame, GIF_MODE_INDEXED only */
+    int      *delays;       /* display time of each frame in msecs, 0 when unset */
+    int       lut_count;
+    void     *map;          /* frame cache mapping backing all the above */
+    size_t    map_size;
 };
 
-GifImages *gif_decode(const char *fname);
+/* scan the file and return its frames undecoded, each one is decoded the
+ * first time gif_get_frame() asks for it into a ring of a single frame */
+GifImages *gif_decode(const char *fname, int mode, const PixelFormat *fmt);
+
+/* keep up to ring decoded frames around, 0 for all of them */
+int gif_set_ring(GifImages *imgs, int ring);
+
+/* the pixels of frame, valid until the ring slot is reused; NULL while
+ * the worker has not reached it yet */
+const char *gif_get_frame(GifImages *imgs, int frame);
+
+/* decode the first frame now and the rest on a worker thread, the ring
+ * must hold every frame */
+int gif_decode_async(GifImages *imgs);
+
+/* whether the worker is still decoding, 0 once it stopped at a bad frame */
+int gif_decode_pending(const GifImages *imgs);
+
+/* whether every frame is in memory, gif_get_frame then only reads and may
+ * be called from more than one thread */
+int gif_decode_complete(const GifImages *imgs);
+
+const uint32_t *gif_get_lut(const GifImages *imgs, int frame);
+
+int gif_get_delay(const GifImages *imgs, int frame);
+
+int gif_get_delta(const GifImages *imgs, int from, int to, GifRect *rect);
+
+void gif_free(GifImages *imgs);
 
-#endif/*_GIFDECODE_H__*/
+#endif/*_GIFDECODE_H_*/
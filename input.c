@@ -1,96 +1,260 @@
 #include "input.h"
+#include "event.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/inotify.h>
 #include <linux/input.h>
 
-#define FT_INPUT_DEVICE     "/dev/input/event"
-#define FT_INPUT_MAX        8
+#define FT_INPUT_DIR        "/dev/input"
+#define FT_INPUT_PREFIX     "event"
+#define FT_INPUT_KEYS_MAX   8
+#define FT_INPUT_DEV_MAX    8
 #define BUFFER_SIZE         64
 #define EVENT_SIZE          sizeof(struct input_event)
 
-static int *open_all_inputs(int *maxfd)
+#define BITS_PER_LONG       (sizeof(long) * 8)
+#define BITS_LONGS(n)       (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define TEST_BIT(bit, map)  (((map)[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+
+typedef struct _InputDevice InputDevice;
+
+struct _InputDevice
 {
-    static int fds[FT_INPUT_MAX+1] = {0};
+    int     fd;
+    char    name[16];   /* eventN, to match inotify removals */
+};
 
-    char input[BUFFER_SIZE] = {0};
-    int fd, max = 0, i = 0;
+struct InputContext
+{
+    InputKeyFunc    func;
+    int             keys[FT_INPUT_KEYS_MAX];
+    int             key_count;
+    int             notify;
+    InputDevice     devices[FT_INPUT_DEV_MAX];
+};
 
-    for (i = 0; i < FT_INPUT_MAX; i++)
-    {
-        snprintf(input, BUFFER_SIZE, "%s%d", FT_INPUT_DEVICE, i);
+static struct InputContext input_ctx;
 
-        fd = open(input, O_RDONLY);
+static void input_close(InputDevice *dev)
+{
+    event_remove(dev->fd);
+    close(dev->fd);
+    dev->fd = -1;
+    dev->name[0] = '\0';
+}
 
-        if (fd < 0)
-            break;
+static void input_on_event(int fd, void *data)
+{
+    InputDevice *dev = data;
+    struct input_event events[BUFFER_SIZE];
+    int byte, i;
 
-        fds[i] = fd;
+    /* drain the queue, a wakeup may carry more than one batch */
+    for (;;)
+    {
+        byte = read(fd, events, EVENT_SIZE * BUFFER_SIZE);
 
-        if (fd > max)
-            max = fd;
-    }
+        /* evdev nodes report removal, pipes their writer going away */
+        if ((byte < 0 && errno == ENODEV) || byte == 0)
+        {
+            input_close(dev);
+            return;
+        }
+
+        if (byte < (int)EVENT_SIZE)
+            return;
 
-    *maxfd = max;
+        stats_count(STATS_INPUT_EVENTS, byte / EVENT_SIZE);
+
+        for (i = 0; i < byte / (int)EVENT_SIZE; i++)
+        {
+            struct input_event *e = &events[i];
 
-    return fds;
+            if (e->type == EV_KEY)
+            {
+                input_ctx.func(e->code, e->value);
+            }
+        }
+    }
 }
 
-static void init_fds(int *fds, fd_set *set)
+static int input_has_keys(int fd)
 {
-    int i = 0;
+    unsigned long bits[BITS_LONGS(KEY_MAX + 1)];
+    int i;
 
-    FD_ZERO(set);
+    memset(bits, 0, sizeof(bits));
 
-    for (i = 0; fds[i]; i++)
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) < 0)
+        return 0;
+
+    for (i = 0; i < input_ctx.key_count; i++)
     {
-        FD_SET(fds[i], set);
+        if (TEST_BIT(input_ctx.keys[i], bits))
+            return 1;
     }
+
+    return 0;
 }
 
-void wait_onkey()
+static int input_open(const char *name)
 {
-    struct input_event events[BUFFER_SIZE];
-    struct input_event *e;
+    char path[PATH_MAX];
+    InputDevice *dev = NULL;
+    int fd, i;
+
+    if (strncmp(name, FT_INPUT_PREFIX, strlen(FT_INPUT_PREFIX)) != 0 ||
+        strlen(name) >= sizeof(dev->name))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < FT_INPUT_DEV_MAX; i++)
+    {
+        if (strcmp(input_ctx.devices[i].name, name) == 0)
+            return -1;
+
+        if (dev == NULL && input_ctx.devices[i].name[0] == '\0')
+            dev = &input_ctx.devices[i];
+    }
 
-    fd_set rfds;
-    int maxfd, retval, i, byte = 0;
-    int *fds;
+    if (dev == NULL)
+        return -1;
 
-    fds = open_all_inputs(&maxfd);
+    snprintf(path, sizeof(path), FT_INPUT_DIR"/%s", name);
 
-    init_fds(fds, &rfds);
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
 
-    while ((retval = select(maxfd + 1, &rfds, NULL, NULL, NULL)))
+    if (fd < 0)
+        return -1;
+
+    /* touchscreens and sensors never report the keys we wait for */
+    if (!input_has_keys(fd) || event_add(fd, input_on_event, dev) < 0)
     {
-        if (retval < 0)
-            continue;
+        close(fd);
+        return -1;
+    }
 
-        for (i = 0; fds[i]; i++)
+    dev->fd = fd;
+    strcpy(dev->name, name);
+    event_set_name(fd, "input");
+
+    return 0;
+}
+
+static void input_on_notify(int fd, void *data)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *e;
+    int len, i;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+    {
+        char *p;
+
+        for (p = buf; p < buf + len; p += sizeof(*e) + e->len)
         {
-            if (FD_ISSET(fds[i], &rfds))
+            e = (const struct inotify_event *)p;
+
+            if (e->len == 0)
+                continue;
+
+            if (e->mask & IN_CREATE)
+            {
+                input_open(e->name);
+            }
+            else if (e->mask & IN_DELETE)
             {
-                byte = read(fds[i], events, EVENT_SIZE * BUFFER_SIZE);
-                break;
+                for (i = 0; i < FT_INPUT_DEV_MAX; i++)
+                {
+                    if (strcmp(input_ctx.devices[i].name, e->name) == 0)
+                        input_close(&input_ctx.devices[i]);
+                }
             }
         }
+    }
+}
 
-        init_fds(fds, &rfds);
+int input_init(InputKeyFunc func, const int *keys, int count)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int i, opened = 0;
 
-        if (byte < EVENT_SIZE)
-            continue;
+    input_ctx.func = func;
+    input_ctx.key_count = count < FT_INPUT_KEYS_MAX ? count : FT_INPUT_KEYS_MAX;
+    memcpy(input_ctx.keys, keys, input_ctx.key_count * sizeof(int));
 
-        for (i = 0; i < byte / EVENT_SIZE; i++)
-        {
-            e = &events[i];
+    for (i = 0; i < FT_INPUT_DEV_MAX; i++)
+        input_ctx.devices[i].fd = -1;
 
-            if (e->type == EV_KEY && e->code == FT_KEY_POWER)
-            {
-                return;
-            }
+    /* watch before the scan so no device slips in between */
+    input_ctx.notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (input_ctx.notify >= 0)
+    {
+        if (inotify_add_watch(input_ctx.notify, FT_INPUT_DIR, IN_CREATE | IN_DELETE) < 0 ||
+            event_add(input_ctx.notify, input_on_notify, NULL) < 0)
+        {
+            perror("inotify "FT_INPUT_DIR);
+            close(input_ctx.notify);
+            input_ctx.notify = -1;
+        }
+        else
+        {
+            event_set_name(input_ctx.notify, "input_notify");
         }
     }
+
+    dir = opendir(FT_INPUT_DIR);
+
+    if (dir == NULL)
+        return 0;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (input_open(entry->d_name) == 0)
+            opened++;
+    }
+
+    closedir(dir);
+
+    return opened;
 }
 
+int input_add_fd(int fd, InputKeyFunc func)
+{
+    int i;
+
+    input_ctx.func = func;
+
+    for (i = 0; i < FT_INPUT_DEV_MAX; i++)
+    {
+        InputDevice *dev = &input_ctx.devices[i];
+
+        if (dev->name[0] != '\0')
+            continue;
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        if (event_add(fd, input_on_event, dev) < 0)
+            return -1;
+
+        dev->fd = fd;
+        snprintf(dev->name, sizeof(dev->name), "fd%d", fd);
+        event_set_name(fd, "input");
+
+        return 0;
+    }
+
+    return -1;
+}
@@ -22,6 +22,13 @@
 
 #define FT_KEY_MOUSE    BTN_TOUCH
 
-void wait_onkey();
+typedef void (*InputKeyFunc)(int code, int value);
+
+/* watch /dev/input from the event loop, including devices plugged in later;
+ * only devices reporting one of keys are opened and func gets their key events */
+int input_init(InputKeyFunc func, const int *keys, int count);
+
+/* read input_events from an already open fd such as a pipe, unfiltered */
+int input_add_fd(int fd, InputKeyFunc func);
 
 #endif/*_FT_INPUT_H_*/
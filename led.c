@@ -0,0 +1,260 @@
+#include "led.h"
+#include "device.h"
+#include "event.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+enum
+{
+    LED_TRIGGER_TIMER       = 1 << 0,
+    LED_TRIGGER_PATTERN     = 1 << 1,
+    LED_TRIGGER_HEARTBEAT   = 1 << 2,
+};
+
+typedef struct _LedState LedState;
+
+struct _LedState
+{
+    char            name[32];
+    int             triggers;   /* LED_TRIGGER_* offered by the kernel */
+    int             max;
+    int             effect;
+    int             period;
+    int             level;      /* last brightness written from userspace */
+    int             soft;       /* animated by led_on_timer() */
+    struct timespec start;
+};
+
+static LedState led_states[LED_STATE_MAX];
+static int led_timer = -1;
+
+static void led_path(char *path, const char *name, const char *attr)
+{
+    snprintf(path, PATH_MAX, DEV_LED_PATH"%s/%s", name, attr);
+}
+
+static int led_parse_triggers(const char *list)
+{
+    char word[32];
+    int triggers = 0, n;
+
+    /* "none [timer] pattern heartbeat ...", the active one in brackets */
+    while (sscanf(list, " %31s%n", word, &n) == 1)
+    {
+        const char *w = word[0] == '[' ? word + 1 : word;
+        int len = strcspn(w, "]");
+
+        if (strncmp(w, "timer", len) == 0 && len == 5)
+            triggers |= LED_TRIGGER_TIMER;
+        else if (strncmp(w, "pattern", len) == 0 && len == 7)
+            triggers |= LED_TRIGGER_PATTERN;
+        else if (strncmp(w, "heartbeat", len) == 0 && len == 9)
+            triggers |= LED_TRIGGER_HEARTBEAT;
+
+        list += n;
+    }
+
+    return triggers;
+}
+
+static LedState *led_get_state(const char *name)
+{
+    char path[PATH_MAX];
+    char list[1024];
+    LedState *led = NULL;
+    int i;
+
+    for (i = 0; i < LED_STATE_MAX; i++)
+    {
+        if (strcmp(led_states[i].name, name) == 0)
+            return &led_states[i];
+
+        if (led == NULL && led_states[i].name[0] == '\0')
+            led = &led_states[i];
+    }
+
+    if (led == NULL || strlen(name) >= sizeof(led->name))
+        return NULL;
+
+    strcpy(led->name, name);
+
+    led_path(path, name, "trigger");
+
+    if (hw_file_read(path, list, sizeof(list)) > 0)
+        led->triggers = led_parse_triggers(list);
+
+    led_path(path, name, "max_brightness");
+    led->max = hw_file_read_int(path);
+
+    if (led->max <= 0)
+        led->max = DEV_LED_FULL;
+
+    return led;
+}
+
+static int led_soft_level(const LedState *led, int elapsed)
+{
+    int phase = elapsed % led->period;
+    int half = led->period / 2;
+
+    switch (led->effect)
+    {
+        case LED_EFFECT_BLINK:
+            return phase < half ? led->max : 0;
+
+        case LED_EFFECT_HEARTBEAT:
+            /* two short beats then a pause */
+            return (phase < led->period / 10 ||
+                    (phase >= led->period / 5 && phase < led->period * 3 / 10)) ? led->max : 0;
+
+        case LED_EFFECT_BREATHE:
+        {
+            /* triangle wave, squared so it looks even to the eye */
+            int tri = phase < half ? phase : led->period - phase;
+
+            return (int)((long long)led->max * tri * tri / ((long long)half * half));
+        }
+
+        default: break;
+    }
+
+    return 0;
+}
+
+static void led_on_timer(int fd, void *data)
+{
+    struct timespec now;
+    char path[PATH_MAX];
+    int i, active = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < LED_STATE_MAX; i++)
+    {
+        LedState *led = &led_states[i];
+        int elapsed, level;
+
+        if (!led->soft)
+            continue;
+
+        elapsed = (now.tv_sec - led->start.tv_sec) * 1000 +
+                  (now.tv_nsec - led->start.tv_nsec) / 1000000;
+        level = led_soft_level(led, elapsed);
+        active = 1;
+
+        if (level != led->level)
+        {
+            led_path(path, led->name, "brightness");
+            hw_file_write_int(path, level);
+            led->level = level;
+        }
+    }
+
+    if (!active)
+        event_timer_set(led_timer, 0, 0);
+}
+
+static void led_soft_start(LedState *led)
+{
+    int i, step = LED_STEP_MS;
+
+    if (led_timer < 0)
+    {
+        led_timer = event_timer_create(CLOCK_MONOTONIC, led_on_timer, NULL);
+        event_set_name(led_timer, "led");
+    }
+
+    if (led_timer < 0)
+        return;
+
+    led->soft = 1;
+    led->level = -1;
+    clock_gettime(CLOCK_MONOTONIC, &led->start);
+
+    /* blinking only needs a tick per edge, breathing a finer one */
+    for (i = 0; i < LED_STATE_MAX; i++)
+    {
+        if (!led_states[i].soft)
+            continue;
+
+        if (led_states[i].effect == LED_EFFECT_BLINK && step == LED_STEP_MS)
+            step = led_states[i].period / 2;
+        else if (led_states[i].effect != LED_EFFECT_BLINK)
+            step = LED_STEP_MS;
+    }
+
+    event_timer_set(led_timer, 1, step);
+}
+
+int led_effect_set(const char *name, int effect, int period)
+{
+    LedState *led = led_get_state(name);
+    char path[PATH_MAX];
+    char value[64];
+
+    if (led == NULL)
+        return -1;
+
+    led->effect = effect;
+    led->period = period > 0 ? period : 2000;
+    led->soft = 0;
+
+    led_path(path, name, "trigger");
+
+    switch (effect)
+    {
+        case LED_EFFECT_BLINK:
+            if (led->triggers & LED_TRIGGER_TIMER)
+            {
+                hw_file_write(path, "timer");
+                led_path(path, name, "delay_on");
+                hw_file_write_int(path, led->period / 2);
+                led_path(path, name, "delay_off");
+                hw_file_write_int(path, led->period / 2);
+                return 0;
+            }
+            break;
+
+        case LED_EFFECT_BREATHE:
+            if (led->triggers & LED_TRIGGER_PATTERN)
+            {
+                /* the pattern trigger ramps linearly between the entries */
+                hw_file_write(path, "pattern");
+                led_path(path, name, "pattern");
+                snprintf(value, sizeof(value), "0 %d %d %d",
+                         led->period / 2, led->max, led->period / 2);
+                hw_file_write(path, value);
+                return 0;
+            }
+            break;
+
+        case LED_EFFECT_HEARTBEAT:
+            if (led->triggers & LED_TRIGGER_HEARTBEAT)
+            {
+                hw_file_write(path, "heartbeat");
+                return 0;
+            }
+            break;
+
+        default: break;
+    }
+
+    /* plain levels, or effects the kernel can not run for us */
+    if (led->triggers)
+        hw_file_write(path, "none");
+
+    led_path(path, name, "brightness");
+
+    if (effect == LED_EFFECT_OFF || effect == LED_EFFECT_ON)
+    {
+        hw_file_write_int(path, effect == LED_EFFECT_ON ? led->max : 0);
+        return 0;
+    }
+
+    led_soft_start(led);
+
+    return 0;
+}
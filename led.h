@@ -0,0 +1,20 @@
+#ifndef _LED_H_
+#define _LED_H_
+
+#define LED_STATE_MAX   4
+#define LED_STEP_MS     40
+
+enum
+{
+    LED_EFFECT_OFF = 0,
+    LED_EFFECT_ON,
+    LED_EFFECT_BLINK,
+    LED_EFFECT_BREATHE,
+    LED_EFFECT_HEARTBEAT,
+};
+
+/* run an effect on /sys/class/leds/<name>, in the kernel when it has a
+ * suitable trigger, from the event loop otherwise; period is in msecs */
+int led_effect_set(const char *name, int effect, int period);
+
+#endif/*_LED_H_*/
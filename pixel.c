@@ -0,0 +1,442 @@
+#include "pixel.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_HAVE_AVX2
+#endif
+
+static void pixel_set_field(struct fb_bitfield *field, int offset, int length)
+{
+    field->offset = offset;
+    field->length = length;
+    field->msb_right = 0;
+}
+
+int pixel_format_init(PixelFormat *fmt, const struct fb_var_screeninfo *vinfo)
+{
+    memset(fmt, 0, sizeof(PixelFormat));
+
+    fmt->depth  = vinfo->bits_per_pixel / 8;
+    fmt->red    = vinfo->red;
+    fmt->green  = vinfo->green;
+    fmt->blue   = vinfo->blue;
+    fmt->transp = vinfo->transp;
+
+    if (fmt->depth < 2 || fmt->depth > 4)
+    {
+        printf("unsupported pixel depth %d\n", vinfo->bits_per_pixel);
+        return -1;
+    }
+
+    /* some drivers leave the bitfields empty, assume the usual layouts */
+    if (!fmt->red.length && !fmt->green.length && !fmt->blue.length)
+    {
+        if (fmt->depth == 2)
+        {
+            pixel_set_field(&fmt->red, 11, 5);
+            pixel_set_field(&fmt->green, 5, 6);
+            pixel_set_field(&fmt->blue, 0, 5);
+        }
+        else
+        {
+            pixel_set_field(&fmt->red, 16, 8);
+            pixel_set_field(&fmt->green, 8, 8);
+            pixel_set_field(&fmt->blue, 0, 8);
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t pixel_channel(int value, const struct fb_bitfield *field)
+{
+    uint32_t v = value & 0xFF;
+
+    if (field->length == 0)
+        return 0;
+
+    if (field->length <= 8)
+        v >>= 8 - field->length;
+    else
+        v <<= field->length - 8;
+
+    return v << field->offset;
+}
+
+uint32_t pixel_make(const PixelFormat *fmt, int r, int g, int b)
+{
+    uint32_t alpha = 0;
+
+    if (fmt->transp.length)
+        alpha = ((1u << fmt->transp.length) - 1) << fmt->transp.offset;
+
+    return pixel_channel(r, &fmt->red)
+         | pixel_channel(g, &fmt->green)
+         | pixel_channel(b, &fmt->blue)
+         | alpha;
+}
+
+static int pixel_channel_get(uint32_t pixel, const struct fb_bitfield *field)
+{
+    uint32_t max;
+
+    if (field->length == 0)
+        return 0;
+
+    max = field->length >= 32 ? 0xFFFFFFFF : (1u << field->length) - 1;
+
+    return (uint64_t)((pixel >> field->offset) & max) * 255 / max;
+}
+
+void pixel_unpack(const PixelFormat *fmt, uint32_t pixel, int *r, int *g, int *b)
+{
+    *r = pixel_channel_get(pixel, &fmt->red);
+    *g = pixel_channel_get(pixel, &fmt->green);
+    *b = pixel_channel_get(pixel, &fmt->blue);
+}
+
+uint32_t pixel_load(const char *p, int depth)
+{
+    const uint8_t *b = (const uint8_t *)p;
+    uint32_t pixel = 0;
+
+    while (depth--)
+        pixel = pixel << 8 | b[depth];
+
+    return pixel;
+}
+
+void pixel_store(char *p, int depth, uint32_t pixel)
+{
+    int i;
+
+    for (i = 0; i < depth; i++, pixel >>= 8)
+        p[i] = pixel;
+}
+
+/* portable kernels, pixels are assembled in registers and written with wide
+ * stores since the destination is usually write combined memory */
+
+static void expand_16_c(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                        int w, int h, const uint32_t *lut)
+{
+    for (; h > 0; h--, dst += dst_pitch, src += src_pitch)
+    {
+        const uint8_t *s = src;
+        uint16_t *d = (uint16_t *)dst;
+        int n = w;
+
+        for (; n >= 8; n -= 8, s += 8, d += 8)
+        {
+            uint64_t idx, lo, hi;
+
+            memcpy(&idx, s, sizeof(idx));
+
+            lo = (uint64_t)lut[idx & 0xFF]
+               | (uint64_t)lut[(idx >> 8) & 0xFF] << 16
+               | (uint64_t)lut[(idx >> 16) & 0xFF] << 32
+               | (uint64_t)lut[(idx >> 24) & 0xFF] << 48;
+            hi = (uint64_t)lut[(idx >> 32) & 0xFF]
+               | (uint64_t)lut[(idx >> 40) & 0xFF] << 16
+               | (uint64_t)lut[(idx >> 48) & 0xFF] << 32
+               | (uint64_t)lut[idx >> 56] << 48;
+
+            memcpy(d, &lo, sizeof(lo));
+            memcpy(d + 4, &hi, sizeof(hi));
+        }
+
+        while (n--)
+        {
+            *d++ = lut[*s++];
+        }
+    }
+}
+
+static void expand_24_c(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                        int w, int h, const uint32_t *lut)
+{
+    for (; h > 0; h--, dst += dst_pitch, src += src_pitch)
+    {
+        const uint8_t *s = src;
+        uint8_t *d = (uint8_t *)dst;
+        int n = w;
+
+        /* four pixels make three 32 bits words */
+        for (; n >= 4; n -= 4, s += 4, d += 12)
+        {
+            uint32_t p0 = lut[s[0]], p1 = lut[s[1]], p2 = lut[s[2]], p3 = lut[s[3]];
+            uint32_t word[3];
+
+            word[0] = (p0 & 0xFFFFFF) | p1 << 24;
+            word[1] = (p1 >> 8 & 0xFFFF) | p2 << 16;
+            word[2] = (p2 >> 16 & 0xFF) | p3 << 8;
+
+            memcpy(d, word, sizeof(word));
+        }
+
+        for (; n > 0; n--, s++, d += 3)
+        {
+            uint32_t p = lut[*s];
+
+            d[0] = p;
+            d[1] = p >> 8;
+            d[2] = p >> 16;
+        }
+    }
+}
+
+static void expand_32_c(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                        int w, int h, const uint32_t *lut)
+{
+    for (; h > 0; h--, dst += dst_pitch, src += src_pitch)
+    {
+        const uint8_t *s = src;
+        uint32_t *d = (uint32_t *)dst;
+        int n = w;
+
+        for (; n >= 4; n -= 4, s += 4, d += 4)
+        {
+            uint32_t px[4] = { lut[s[0]], lut[s[1]], lut[s[2]], lut[s[3]] };
+
+            memcpy(d, px, sizeof(px));
+        }
+
+        while (n--)
+        {
+            *d++ = lut[*s++];
+        }
+    }
+}
+
+#ifdef PIXEL_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static void expand_16_avx2(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                           int w, int h, const uint32_t *lut)
+{
+    for (; h > 0; h--, dst += dst_pitch, src += src_pitch)
+    {
+        const uint8_t *s = src;
+        uint16_t *d = (uint16_t *)dst;
+        int n = w;
+
+        for (; n >= 16; n -= 16, s += 16, d += 16)
+        {
+            __m256i i0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)s));
+            __m256i i1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(s + 8)));
+            __m256i p0 = _mm256_i32gather_epi32((const int *)lut, i0, 4);
+            __m256i p1 = _mm256_i32gather_epi32((const int *)lut, i1, 4);
+
+            /* pixels fit in 16 bits so the saturating pack is exact, it
+             * works per 128 bits lane hence the final permute */
+            __m256i px = _mm256_permute4x64_epi64(_mm256_packus_epi32(p0, p1), 0xD8);
+
+            _mm256_storeu_si256((__m256i *)d, px);
+        }
+
+        while (n--)
+        {
+            *d++ = lut[*s++];
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void expand_32_avx2(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                           int w, int h, const uint32_t *lut)
+{
+    for (; h > 0; h--, dst += dst_pitch, src += src_pitch)
+    {
+        const uint8_t *s = src;
+        uint32_t *d = (uint32_t *)dst;
+        int n = w;
+
+        for (; n >= 8; n -= 8, s += 8, d += 8)
+        {
+            __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)s));
+
+            _mm256_storeu_si256((__m256i *)d,
+                    _mm256_i32gather_epi32((const int *)lut, idx, 4));
+        }
+
+        while (n--)
+        {
+            *d++ = lut[*s++];
+        }
+    }
+}
+
+#endif/*PIXEL_HAVE_AVX2*/
+
+#if defined(__aarch64__)
+
+/* NEON has no gather, but tbl looks bytes up in 64 byte tables: the lut is
+ * split into one 256 byte plane per pixel byte, each plane is searched as
+ * four 64 byte tables (out of range indices yield 0) and the planes are
+ * interleaved back into pixels by vst2/vst3/vst4 */
+
+static uint8x16_t neon_lookup(const uint8x16x4_t *tab, uint8x16_t idx)
+{
+    const uint8x16_t step = vdupq_n_u8(64);
+    uint8x16_t r = vqtbl4q_u8(tab[0], idx);
+
+    idx = vsubq_u8(idx, step);
+    r = vorrq_u8(r, vqtbl4q_u8(tab[1], idx));
+    idx = vsubq_u8(idx, step);
+    r = vorrq_u8(r, vqtbl4q_u8(tab[2], idx));
+    idx = vsubq_u8(idx, step);
+
+    return vorrq_u8(r, vqtbl4q_u8(tab[3], idx));
+}
+
+static void expand_neon(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                        int w, int h, const uint32_t *lut, int depth)
+{
+    uint8_t planes[4][256];
+    uint8x16x4_t tab[4][4];
+    int i, b;
+
+    for (i = 0; i < 256; i++)
+    {
+        for (b = 0; b < depth; b++)
+            planes[b][i] = lut[i] >> (8 * b);
+    }
+
+    for (b = 0; b < depth; b++)
+    {
+        for (i = 0; i < 4; i++)
+            tab[b][i] = vld1q_u8_x4(planes[b] + 64 * i);
+    }
+
+    for (; h > 0; h--, dst += dst_pitch, src += src_pitch)
+    {
+        const uint8_t *s = src;
+        uint8_t *d = (uint8_t *)dst;
+        int n = w;
+
+        for (; n >= 16; n -= 16, s += 16, d += 16 * depth)
+        {
+            uint8x16_t idx = vld1q_u8(s);
+
+            if (depth == 2)
+            {
+                uint8x16x2_t px = {{ neon_lookup(tab[0], idx), neon_lookup(tab[1], idx) }};
+                vst2q_u8(d, px);
+            }
+            else if (depth == 3)
+            {
+                uint8x16x3_t px = {{ neon_lookup(tab[0], idx), neon_lookup(tab[1], idx),
+                                     neon_lookup(tab[2], idx) }};
+                vst3q_u8(d, px);
+            }
+            else
+            {
+                uint8x16x4_t px = {{ neon_lookup(tab[0], idx), neon_lookup(tab[1], idx),
+                                     neon_lookup(tab[2], idx), neon_lookup(tab[3], idx) }};
+                vst4q_u8(d, px);
+            }
+        }
+
+        for (; n > 0; n--, s++, d += depth)
+        {
+            for (b = 0; b < depth; b++)
+                d[b] = planes[b][*s];
+        }
+    }
+}
+
+static void expand_16_neon(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                           int w, int h, const uint32_t *lut)
+{
+    expand_neon(dst, dst_pitch, src, src_pitch, w, h, lut, 2);
+}
+
+static void expand_24_neon(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                           int w, int h, const uint32_t *lut)
+{
+    expand_neon(dst, dst_pitch, src, src_pitch, w, h, lut, 3);
+}
+
+static void expand_32_neon(char *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+                           int w, int h, const uint32_t *lut)
+{
+    expand_neon(dst, dst_pitch, src, src_pitch, w, h, lut, 4);
+}
+
+#endif/*__aarch64__*/
+
+typedef struct _PixelKernel PixelKernel;
+
+struct _PixelKernel
+{
+    const char         *name;
+    PixelExpandFunc     expand[3];  /* 16, 24 and 32 bits */
+};
+
+/* in order of preference, the portable kernel always comes last */
+static const PixelKernel pixel_kernels[] =
+{
+#if defined(__aarch64__)
+    { "neon", { expand_16_neon, expand_24_neon, expand_32_neon } },
+#endif
+#ifdef PIXEL_HAVE_AVX2
+    { "avx2", { expand_16_avx2, expand_24_c, expand_32_avx2 } },
+#endif
+    { "c",    { expand_16_c, expand_24_c, expand_32_c } },
+};
+
+#define PIXEL_KERNEL_COUNT  (int)(sizeof(pixel_kernels) / sizeof(pixel_kernels[0]))
+
+static const PixelKernel *pixel_kernel = NULL;
+
+static int pixel_kernel_supported(const PixelKernel *kernel)
+{
+#ifdef PIXEL_HAVE_AVX2
+    if (strcmp(kernel->name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+int pixel_set_kernel(const char *name)
+{
+    int i;
+
+    for (i = 0; i < PIXEL_KERNEL_COUNT; i++)
+    {
+        const PixelKernel *kernel = &pixel_kernels[i];
+
+        if ((name == NULL || strcmp(kernel->name, name) == 0) &&
+            pixel_kernel_supported(kernel))
+        {
+            pixel_kernel = kernel;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const char *pixel_get_kernel_name()
+{
+    if (pixel_kernel == NULL)
+        pixel_set_kernel(NULL);
+
+    return pixel_kernel->name;
+}
+
+PixelExpandFunc pixel_get_expander(int depth)
+{
+    if (depth < 2 || depth > 4)
+        return NULL;
+
+    if (pixel_kernel == NULL)
+        pixel_set_kernel(NULL);
+
+    return pixel_kernel->expand[depth - 2];
+}
@@ -0,0 +1,40 @@
+#include <linux/fb.h>
+#include <stdint.h>
+
+#ifndef _PIXEL_H_
+#define _PIXEL_H_
+
+typedef struct _PixelFormat PixelFormat;
+
+struct _PixelFormat
+{
+    int                 depth;      /* bytes per pixel, 2, 3 or 4 */
+    struct fb_bitfield  red;
+    struct fb_bitfield  green;
+    struct fb_bitfield  blue;
+    struct fb_bitfield  transp;
+};
+
+/* expand w*h palette indices into pixels through a 256 entry lut */
+typedef void (*PixelExpandFunc)(char *dst, int dst_pitch,
+                                const uint8_t *src, int src_pitch,
+                                int w, int h, const uint32_t *lut);
+
+int pixel_format_init(PixelFormat *fmt, const struct fb_var_screeninfo *vinfo);
+
+uint32_t pixel_make(const PixelFormat *fmt, int r, int g, int b);
+
+void pixel_unpack(const PixelFormat *fmt, uint32_t pixel, int *r, int *g, int *b);
+
+uint32_t pixel_load(const char *p, int depth);
+
+void pixel_store(char *p, int depth, uint32_t pixel);
+
+/* pick the conversion kernel by name, NULL selects the best supported one */
+int pixel_set_kernel(const char *name);
+
+const char *pixel_get_kernel_name();
+
+PixelExpandFunc pixel_get_expander(int depth);
+
+#endif/*_PIXEL_H_*/
@@ -0,0 +1,339 @@
+#include "scale.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* source position of every destination column or row, sampled at pixel
+ * centers; weights are 0..256 towards the next source pixel */
+typedef struct _ScaleMap ScaleMap;
+
+struct _ScaleMap
+{
+    int    *pos;
+    int    *weight;
+};
+
+static void scale_map_init(ScaleMap *map, int src, int dst, int filter)
+{
+    int i;
+
+    map->pos = malloc(sizeof(int) * dst);
+    map->weight = calloc(dst, sizeof(int));
+
+    for (i = 0; i < dst; i++)
+    {
+        /* 16.16 fixed point of (i + 0.5) * src / dst - 0.5 */
+        int64_t fx = ((int64_t)(2 * i + 1) * src << 16) / (2 * dst) - (1 << 15);
+
+        if (filter == SCALE_NEAREST)
+        {
+            map->pos[i] = (int)(((int64_t)i * src + src / 2) / dst);
+            continue;
+        }
+
+        if (fx < 0)
+            fx = 0;
+
+        map->pos[i] = fx >> 16;
+        map->weight[i] = (fx & 0xFFFF) >> 8;
+
+        /* keep pos + 1 inside the source, the simd path reads it */
+        if (map->pos[i] >= src - 1)
+        {
+            map->pos[i] = src > 1 ? src - 2 : 0;
+            map->weight[i] = src > 1 ? 256 : 0;
+        }
+    }
+}
+
+static void scale_map_free(ScaleMap *map)
+{
+    free(map->pos);
+    free(map->weight);
+}
+
+static void scale_nearest(char *dst, int dst_w, int dst_h, const char *src, int src_w,
+                          int depth, const ScaleMap *mx, const ScaleMap *my)
+{
+    int x, y;
+
+    for (y = 0; y < dst_h; y++)
+    {
+        const char *row = src + my->pos[y] * src_w * depth;
+
+        for (x = 0; x < dst_w; x++, dst += depth)
+            memcpy(dst, row + mx->pos[x] * depth, depth);
+    }
+}
+
+static int lerp(int a, int b, int w)
+{
+    return (a * (256 - w) + b * w) >> 8;
+}
+
+static void scale_bilinear_c(char *dst, int dst_w, int dst_h, const char *src, int src_w,
+                             int src_h, const PixelFormat *fmt, const ScaleMap *mx,
+                             const ScaleMap *my)
+{
+    int depth = fmt->depth;
+    int x, y, i;
+
+    for (y = 0; y < dst_h; y++)
+    {
+        int y1 = my->pos[y] + (src_h > 1);
+        const char *row0 = src + my->pos[y] * src_w * depth;
+        const char *row1 = src + y1 * src_w * depth;
+
+        for (x = 0; x < dst_w; x++, dst += depth)
+        {
+            int x0 = mx->pos[x] * depth, x1 = (mx->pos[x] + (src_w > 1)) * depth;
+            int c[4][3], v[3];
+
+            pixel_unpack(fmt, pixel_load(row0 + x0, depth), &c[0][0], &c[0][1], &c[0][2]);
+            pixel_unpack(fmt, pixel_load(row0 + x1, depth), &c[1][0], &c[1][1], &c[1][2]);
+            pixel_unpack(fmt, pixel_load(row1 + x0, depth), &c[2][0], &c[2][1], &c[2][2]);
+            pixel_unpack(fmt, pixel_load(row1 + x1, depth), &c[3][0], &c[3][1], &c[3][2]);
+
+            for (i = 0; i < 3; i++)
+            {
+                v[i] = lerp(lerp(c[0][i], c[1][i], mx->weight[x]),
+                            lerp(c[2][i], c[3][i], mx->weight[x]), my->weight[y]);
+            }
+
+            pixel_store(dst, depth, pixel_make(fmt, v[0], v[1], v[2]));
+        }
+    }
+}
+
+#if defined(__SSE2__) || defined(__aarch64__)
+
+/* with 32 bits pixels made of byte wide channels every byte lane can be
+ * interpolated on its own, whatever the channel order is */
+static int scale_bytewise(const PixelFormat *fmt)
+{
+    const struct fb_bitfield *fields[4] = { &fmt->red, &fmt->green, &fmt->blue, &fmt->transp };
+    int i;
+
+    if (fmt->depth != 4)
+        return 0;
+
+    for (i = 0; i < 4; i++)
+    {
+        if (fields[i]->length && (fields[i]->length != 8 || fields[i]->offset % 8))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void scale_bilinear_32(char *dst, int dst_w, int dst_h, const char *src, int src_w,
+                              const ScaleMap *mx, const ScaleMap *my)
+{
+    int x, y;
+
+    for (y = 0; y < dst_h; y++)
+    {
+        const uint8_t *row0 = (const uint8_t *)src + my->pos[y] * src_w * 4;
+        const uint8_t *row1 = row0 + src_w * 4;
+        int wy = my->weight[y];
+
+        for (x = 0; x < dst_w; x++, dst += 4)
+        {
+            int wx = mx->weight[x];
+            int x0 = mx->pos[x] * 4;
+#if defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            /* left pixel weights in the low half, right pixel in the high half */
+            __m128i w = _mm_set_epi16(wx, wx, wx, wx, 256 - wx, 256 - wx, 256 - wx, 256 - wx);
+            __m128i top = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row0 + x0)), zero);
+            __m128i bot = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row1 + x0)), zero);
+
+            top = _mm_mullo_epi16(top, w);
+            bot = _mm_mullo_epi16(bot, w);
+            top = _mm_srli_epi16(_mm_add_epi16(top, _mm_srli_si128(top, 8)), 8);
+            bot = _mm_srli_epi16(_mm_add_epi16(bot, _mm_srli_si128(bot, 8)), 8);
+
+            top = _mm_add_epi16(_mm_mullo_epi16(top, _mm_set1_epi16(256 - wy)),
+                                _mm_mullo_epi16(bot, _mm_set1_epi16(wy)));
+            top = _mm_srli_epi16(top, 8);
+
+            int px = _mm_cvtsi128_si32(_mm_packus_epi16(top, top));
+            memcpy(dst, &px, 4);
+#else
+            const uint16_t wl[8] = { 256 - wx, 256 - wx, 256 - wx, 256 - wx, wx, wx, wx, wx };
+            uint16x8_t w = vld1q_u16(wl);
+            uint16x8_t top = vmulq_u16(vmovl_u8(vld1_u8(row0 + x0)), w);
+            uint16x8_t bot = vmulq_u16(vmovl_u8(vld1_u8(row1 + x0)), w);
+            uint16x4_t t = vshr_n_u16(vadd_u16(vget_low_u16(top), vget_high_u16(top)), 8);
+            uint16x4_t b = vshr_n_u16(vadd_u16(vget_low_u16(bot), vget_high_u16(bot)), 8);
+            uint16x4_t v = vshr_n_u16(vadd_u16(vmul_n_u16(t, 256 - wy), vmul_n_u16(b, wy)), 8);
+            uint8x8_t px = vmovn_u16(vcombine_u16(v, v));
+
+            vst1_lane_u32((uint32_t *)dst, vreinterpret_u32_u8(px), 0);
+#endif
+        }
+    }
+}
+
+#endif
+
+static void scale_rect(GifRect *dst, const GifRect *src, int src_w, int src_h,
+                       int dst_w, int dst_h, int filter)
+{
+    /* bilinear output depends on one more source pixel on each side */
+    int pad = (filter == SCALE_BILINEAR) ? 1 : 0;
+    int x0, y0, x1, y1;
+
+    if (src->w <= 0 || src->h <= 0)
+    {
+        memset(dst, 0, sizeof(GifRect));
+        return;
+    }
+
+    x0 = (int)((int64_t)(src->x - pad) * dst_w / src_w) - 1;
+    y0 = (int)((int64_t)(src->y - pad) * dst_h / src_h) - 1;
+    x1 = (int)(((int64_t)(src->x + src->w + pad) * dst_w + src_w - 1) / src_w) + 1;
+    y1 = (int)(((int64_t)(src->y + src->h + pad) * dst_h + src_h - 1) / src_h) + 1;
+
+    dst->x = x0 < 0 ? 0 : x0;
+    dst->y = y0 < 0 ? 0 : y0;
+    dst->w = (x1 > dst_w ? dst_w : x1) - dst->x;
+    dst->h = (y1 > dst_h ? dst_h : y1) - dst->y;
+}
+
+typedef struct _ScaleSource ScaleSource;
+
+/* what a scaled GifImages produces its frames from */
+struct _ScaleSource
+{
+    GifImages  *imgs;
+    ScaleMap    mx, my;
+    int         filter;
+    PixelFormat fmt;
+};
+
+static int scale_load(GifImages *out, int frame, char *dst)
+{
+    ScaleSource *source = out->source;
+    GifImages *imgs = source->imgs;
+    const char *src = gif_get_frame(imgs, frame);
+
+    if (src == NULL)
+        return -1;
+
+    if (source->filter == SCALE_NEAREST)
+    {
+        scale_nearest(dst, out->w, out->h, src, imgs->w, imgs->depth, &source->mx, &source->my);
+    }
+#if defined(__SSE2__) || defined(__aarch64__)
+    else if (scale_bytewise(&source->fmt) && imgs->w > 1 && imgs->h > 1)
+    {
+        scale_bilinear_32(dst, out->w, out->h, src, imgs->w, &source->mx, &source->my);
+    }
+#endif
+    else
+    {
+        scale_bilinear_c(dst, out->w, out->h, src, imgs->w, imgs->h, &source->fmt,
+                         &source->mx, &source->my);
+    }
+
+    /* decoding may have narrowed the source rect */
+    if (frame > 0)
+    {
+        scale_rect(&out->rects[frame], &imgs->rects[frame], imgs->w, imgs->h,
+                   out->w, out->h, source->filter);
+    }
+
+    return 0;
+}
+
+static void scale_release(void *data)
+{
+    ScaleSource *source = data;
+
+    scale_map_free(&source->mx);
+    scale_map_free(&source->my);
+    gif_free(source->imgs);
+    free(source);
+}
+
+GifImages *scale_images(GifImages *imgs, int w, int h, int filter,
+                        const PixelFormat *fmt)
+{
+    ScaleSource *source;
+    GifImages *out;
+    int i;
+
+    /* fit inside w x h keeping the aspect ratio */
+    if ((int64_t)imgs->w * h > (int64_t)imgs->h * w)
+        h = (int)((int64_t)imgs->h * w / imgs->w);
+    else
+        w = (int)((int64_t)imgs->w * h / imgs->h);
+
+    if (w <= 0 || h <= 0)
+        return NULL;
+
+    /* palette indices can not be blended */
+    if (imgs->mode == GIF_MODE_INDEXED)
+        filter = SCALE_NEAREST;
+
+    /* each source frame is only needed while its scaled copy is made */
+    if (imgs->ring > 1 && gif_set_ring(imgs, 1) < 0)
+        return NULL;
+
+    source = calloc(1, sizeof(ScaleSource));
+    source->imgs = imgs;
+    source->filter = filter;
+    source->fmt = *fmt;
+
+    out = calloc(1, sizeof(GifImages));
+    out->w = w;
+    out->h = h;
+    out->count = imgs->count;
+    out->mode = imgs->mode;
+    out->depth = imgs->depth;
+    out->size = w * h * imgs->depth;
+    out->lut_count = imgs->lut_count;
+    out->load = scale_load;
+    out->release = scale_release;
+    out->source = source;
+    out->rects = malloc(sizeof(GifRect) * imgs->count);
+    out->frame_luts = malloc(sizeof(int) * imgs->count);
+    out->luts = malloc(sizeof(uint32_t) * GIF_COLOR_TABLE_MAX * imgs->lut_count);
+    out->delays = malloc(sizeof(int) * imgs->count);
+
+    memcpy(out->frame_luts, imgs->frame_luts, sizeof(int) * imgs->count);
+    memcpy(out->delays, imgs->delays, sizeof(int) * imgs->count);
+    memcpy(out->luts, imgs->luts, sizeof(uint32_t) * GIF_COLOR_TABLE_MAX * imgs->lut_count);
+
+    scale_map_init(&source->mx, imgs->w, w, filter);
+    scale_map_init(&source->my, imgs->h, h, filter);
+
+    printf("Scale: %dx%d -> %dx%d, %s\n", imgs->w, imgs->h, w, h,
+            filter == SCALE_NEAREST ? "nearest" : "bilinear");
+
+    out->rects[0].x = 0;
+    out->rects[0].y = 0;
+    out->rects[0].w = w;
+    out->rects[0].h = h;
+
+    for (i = 1; i < imgs->count; i++)
+    {
+        scale_rect(&out->rects[i], &imgs->rects[i], imgs->w, imgs->h, w, h, filter);
+    }
+
+    if (gif_set_ring(out, 1) < 0)
+    {
+        gif_free(out);
+        return NULL;
+    }
+
+    return out;
+}
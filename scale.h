@@ -0,0 +1,18 @@
+#include "gifdecode.h"
+
+#ifndef _SCALE_H_
+#define _SCALE_H_
+
+enum
+{
+    SCALE_NEAREST = 0,
+    SCALE_BILINEAR,
+};
+
+/* rescale every frame to the largest size fitting w x h with the same aspect;
+ * frames are scaled as they are asked for and the result owns imgs. indexed
+ * frames are always scaled nearest whatever the filter asked for */
+GifImages *scale_images(GifImages *imgs, int w, int h, int filter,
+                        const PixelFormat *fmt);
+
+#endif/*_SCALE_H_*/
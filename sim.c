@@ -0,0 +1,665 @@
+/* host replay of a charge session against a simulated device: a temporary
+ * tree of fake sysfs files, a framebuffer in memory, a socket pair in place
+ * of the uevent netlink socket and a pipe for input events. the script runs
+ * in real time and nothing suspends: writing mem to the power state only
+ * changes a file, and alarms fire after their real delay. the costs are
+ * printed as json on stdout, scaled to an hour of the device kept awake,
+ * not to an hour of a charge session that mostly sleeps:
+ *
+ *   charge_sim [-b charge binary] [-g file.gif] [-f WxHxBPP] [-t seconds] [script]
+ *
+ * the binary defaults to charge_host next to charge_sim itself.
+ *
+ * script lines are "<seconds> <command> <value>" with the commands
+ * capacity, status, ac, usb and key (power or a key code); ac-notype and
+ * usb-notype report the charger the way kernels without POWER_SUPPLY_TYPE
+ * do. without a script the battery charges from 50% to full and unplugging
+ * ends it.
+ */
+
+#include "input.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define SIM_DEFAULT_BINARY  "charge_host"
+#define SIM_DEFAULT_GIF     "data/battery.gif"
+#define SIM_DEFAULT_MODE    "480x800x16"
+#define SIM_DEFAULT_TIME    120
+#define SIM_EVENTS_MAX      256
+#define SIM_OUTPUT_MAX      4096
+#define SIM_EXIT_TIME       5       /* seconds for charge to exit after the script */
+
+#define SIM_ANIMATION       "/system/usr/share/charge/battery.gif"
+#define SIM_SUPPLY_PATH     "/sys/class/power_supply/"
+#define SIM_STATS_FILE      "/cache/charge/stats"
+
+typedef struct _SimEvent SimEvent;
+
+struct _SimEvent
+{
+    double      at;         /* seconds from the start */
+    char        command[16];
+    char        value[32];
+};
+
+typedef struct _SimStats SimStats;
+
+struct _SimStats
+{
+    unsigned long long syscr, syscw, wchar;
+    unsigned long long voluntary, involuntary;
+};
+
+/* the attributes charge reads or writes, relative to the root */
+static const char *sim_files[][2] =
+{
+    { SIM_SUPPLY_PATH "battery/status",             "Charging" },
+    { SIM_SUPPLY_PATH "battery/capacity",           "50" },
+    { SIM_SUPPLY_PATH "ac/online",                  "1" },
+    { SIM_SUPPLY_PATH "usb/online",                 "0" },
+    { "/sys/class/backlight/micco-bl/brightness",   "102" },
+    { "/sys/class/backlight/micco-bl/max_brightness", "255" },
+    { "/sys/class/leds/red/brightness",             "0" },
+    { "/sys/class/leds/red/max_brightness",         "255" },
+    { "/sys/class/leds/red/trigger",                "[none] timer heartbeat" },
+    { "/sys/class/leds/red/delay_on",               "0" },
+    { "/sys/class/leds/red/delay_off",              "0" },
+    { "/sys/class/leds/green/brightness",           "0" },
+    { "/sys/class/leds/green/max_brightness",       "255" },
+    { "/sys/class/leds/green/trigger",              "[none] timer heartbeat" },
+    { "/sys/class/leds/green/delay_on",             "0" },
+    { "/sys/class/leds/green/delay_off",            "0" },
+    { "/sys/class/timed_output/vibrator/enable",    "0" },
+    { "/sys/power/state",                           "" },
+    { "/sys/power/wake_lock",                       "" },
+    { "/sys/power/wake_unlock",                     "" },
+    { "/sys/class/rtc/rtc0/wakealarm",              "" },
+};
+
+static char sim_root[] = "/tmp/charge-sim-XXXXXX";
+static SimEvent sim_events[SIM_EVENTS_MAX];
+static int sim_count = 0;
+static int sim_uevents = 0, sim_keys = 0;
+
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* create path below the root with all its parents */
+static int sim_write_file(const char *path, const char *text)
+{
+    char full[PATH_MAX], *p;
+    int fd, len = strlen(text);
+
+    snprintf(full, sizeof(full), "%s%s", sim_root, path);
+
+    for (p = full + strlen(sim_root) + 1; (p = strchr(p, '/')) != NULL; p++)
+    {
+        *p = '\0';
+        mkdir(full, 0755);
+        *p = '/';
+    }
+
+    fd = open(full, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        perror(full);
+        return -1;
+    }
+
+    if (write(fd, text, len) != len)
+    {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+static int sim_copy_file(const char *src, const char *path)
+{
+    char buf[65536];
+    int in, out = -1, len, ret = -1;
+
+    in = open(src, O_RDONLY);
+
+    if (in < 0 || sim_write_file(path, "") < 0)
+        goto FAIL;
+
+    snprintf(buf, sizeof(buf), "%s%s", sim_root, path);
+    out = open(buf, O_WRONLY);
+
+    if (out < 0)
+        goto FAIL;
+
+    while ((len = read(in, buf, sizeof(buf))) > 0)
+    {
+        if (write(out, buf, len) != len)
+            goto FAIL;
+    }
+
+    ret = len;
+
+FAIL:
+    if (ret < 0)
+        perror(src);
+
+    if (in >= 0)
+        close(in);
+
+    if (out >= 0)
+        close(out);
+
+    return ret;
+}
+
+static void sim_remove(const char *path)
+{
+    char child[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir = opendir(path);
+
+    while (dir && (entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+
+        if (entry->d_type == DT_DIR)
+            sim_remove(child);
+        else
+            unlink(child);
+    }
+
+    if (dir)
+        closedir(dir);
+
+    rmdir(path);
+}
+
+/* the supply attribute changes, then the kernel reports it, with its type
+ * unless typed is 0 */
+static void sim_supply_change(int sock, const char *supply, const char *attr,
+                              const char *key, const char *value, int typed)
+{
+    char path[PATH_MAX], buf[512];
+    int len;
+
+    snprintf(path, sizeof(path), SIM_SUPPLY_PATH "%s/%s", supply, attr);
+    sim_write_file(path, value);
+
+    len = snprintf(buf, sizeof(buf),
+            "change@/devices/power_supply/%s%c"
+            "ACTION=change%c"
+            "DEVPATH=/devices/power_supply/%s%c"
+            "SUBSYSTEM=power_supply%c"
+            "POWER_SUPPLY_NAME=%s%c",
+            supply, 0, 0, supply, 0, 0, supply, 0);
+
+    if (typed)
+        len += snprintf(buf + len, sizeof(buf) - len, "POWER_SUPPLY_TYPE=%s%c",
+                        strcmp(supply, "ac") == 0 ? "Mains" :
+                        strcmp(supply, "usb") == 0 ? "USB" : "Battery", 0);
+
+    len += snprintf(buf + len, sizeof(buf) - len, "%s=%s", key, value);
+
+    if (send(sock, buf, len + 1, 0) == len + 1)
+        sim_uevents++;
+}
+
+static void sim_key(int input, int code)
+{
+    struct input_event events[4];
+    int i;
+
+    memset(events, 0, sizeof(events));
+
+    for (i = 0; i < 4; i++)
+    {
+        gettimeofday(&events[i].time, NULL);
+        events[i].type = i & 1 ? EV_SYN : EV_KEY;
+        events[i].code = i & 1 ? SYN_REPORT : code;
+        events[i].value = i < 2;
+    }
+
+    if (write(input, events, sizeof(events)) == sizeof(events))
+        sim_keys++;
+}
+
+static void sim_apply(const SimEvent *ev, int sock, int input)
+{
+    if (strcmp(ev->command, "capacity") == 0)
+    {
+        sim_supply_change(sock, "battery", "capacity", "POWER_SUPPLY_CAPACITY", ev->value, 1);
+    }
+    else if (strcmp(ev->command, "status") == 0)
+    {
+        sim_supply_change(sock, "battery", "status", "POWER_SUPPLY_STATUS", ev->value, 1);
+    }
+    else if (strcmp(ev->command, "ac") == 0 || strcmp(ev->command, "usb") == 0)
+    {
+        sim_supply_change(sock, ev->command, "online", "POWER_SUPPLY_ONLINE", ev->value, 1);
+    }
+    else if (strcmp(ev->command, "ac-notype") == 0 || strcmp(ev->command, "usb-notype") == 0)
+    {
+        sim_supply_change(sock, ev->command[0] == 'a' ? "ac" : "usb", "online",
+                          "POWER_SUPPLY_ONLINE", ev->value, 0);
+    }
+    else if (strcmp(ev->command, "key") == 0)
+    {
+        sim_key(input, strcmp(ev->value, "power") == 0 ? FT_KEY_POWER : atoi(ev->value));
+    }
+    else
+    {
+        fprintf(stderr, "sim: unknown command %s\n", ev->command);
+    }
+}
+
+static int sim_add(double at, const char *command, const char *value)
+{
+    SimEvent *ev;
+
+    if (sim_count >= SIM_EVENTS_MAX)
+        return -1;
+
+    ev = &sim_events[sim_count++];
+    ev->at = at;
+    snprintf(ev->command, sizeof(ev->command), "%s", command);
+    snprintf(ev->value, sizeof(ev->value), "%s", value);
+
+    return 0;
+}
+
+static int sim_load_script(const char *fname)
+{
+    char line[128], command[16], value[32];
+    FILE *fp = fopen(fname, "r");
+    double at;
+
+    if (fp == NULL)
+    {
+        perror(fname);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (line[0] == '#' || sscanf(line, "%lf %15s %31s", &at, command, value) != 3)
+            continue;
+
+        if (sim_add(at, command, value) < 0)
+            break;
+    }
+
+    fclose(fp);
+
+    return sim_count > 0 ? 0 : -1;
+}
+
+/* 50% to 100% in steps spread over the session, full, then the charger
+ * goes without saying its type */
+static void sim_default_script(int seconds)
+{
+    char value[8];
+    int capacity;
+
+    for (capacity = 55; capacity <= 100; capacity += 5)
+    {
+        snprintf(value, sizeof(value), "%d", capacity);
+        sim_add(seconds * 0.9 * (capacity - 50) / 50, "capacity", value);
+    }
+
+    sim_add(seconds * 0.9, "status", "Full");
+    sim_add(seconds, "ac-notype", "0");
+}
+
+/* keep the pipe from filling up, charge's output goes on to stderr */
+static int sim_read_output(int fd)
+{
+    char buf[SIM_OUTPUT_MAX];
+    int len = read(fd, buf, sizeof(buf));
+
+    if (len > 0)
+        fwrite(buf, 1, len, stderr);
+
+    return len;
+}
+
+/* sleep until deadline draining the output, or only until it ends */
+static int sim_wait_until(double deadline, int output, int until_end)
+{
+    struct pollfd pfd = { output, POLLIN, 0 };
+    double left;
+
+    while ((left = deadline - now_sec()) > 0)
+    {
+        if (poll(&pfd, 1, (int)(left * 1000) + 1) <= 0)
+            continue;
+
+        if (sim_read_output(output) <= 0)
+        {
+            if (until_end)
+                return 0;
+
+            pfd.fd = -1;
+        }
+    }
+
+    return -1;
+}
+
+static int sim_sample(pid_t pid, SimStats *stats)
+{
+    char path[PATH_MAX], line[128];
+    struct dirent *entry;
+    FILE *fp;
+    DIR *dir;
+
+    memset(stats, 0, sizeof(*stats));
+
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        sscanf(line, "syscr: %llu", &stats->syscr);
+        sscanf(line, "syscw: %llu", &stats->syscw);
+        sscanf(line, "wchar: %llu", &stats->wchar);
+    }
+
+    fclose(fp);
+
+    /* every thread sleeping and waking again counts as a switch */
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    dir = opendir(path);
+
+    while (dir && (entry = readdir(dir)) != NULL)
+    {
+        unsigned long long n;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/status", pid, entry->d_name);
+        fp = fopen(path, "r");
+
+        while (fp && fgets(line, sizeof(line), fp))
+        {
+            if (sscanf(line, "voluntary_ctxt_switches: %llu", &n) == 1)
+                stats->voluntary += n;
+            else if (sscanf(line, "nonvoluntary_ctxt_switches: %llu", &n) == 1)
+                stats->involuntary += n;
+        }
+
+        if (fp)
+            fclose(fp);
+    }
+
+    if (dir)
+        closedir(dir);
+
+    return 0;
+}
+
+/* one counter from charge's stats file, 0 when it is missing */
+static unsigned long long sim_stat(const char *counter)
+{
+    char path[PATH_MAX], line[512], name[32];
+    unsigned long long value = 0, n;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s%s", sim_root, SIM_STATS_FILE);
+    fp = fopen(path, "r");
+
+    while (fp && fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, "%31s %llu", name, &n) == 2 && strcmp(name, counter) == 0)
+            value = n;
+    }
+
+    if (fp)
+        fclose(fp);
+
+    return value;
+}
+
+/* charge's own counters, dumped as it exits: counters are "name value",
+ * histograms "name count total_us max_us buckets..." */
+static void sim_print_stats()
+{
+    char path[PATH_MAX], line[512], name[32];
+    unsigned long long count, total, max;
+    int first = 1;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s%s", sim_root, SIM_STATS_FILE);
+    fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return;
+
+    printf(", \"stats\": {");
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        int n = sscanf(line, "%31s %llu %llu %llu", name, &count, &total, &max);
+
+        if (n == 2)
+            printf("%s\"%s\": %llu", first ? "" : ", ", name, count);
+        else if (n == 4)
+            printf("%s\"%s\": {\"count\": %llu, \"total_us\": %llu, \"max_us\": %llu}",
+                   first ? "" : ", ", name, count, total, max);
+        else
+            continue;
+
+        first = 0;
+    }
+
+    printf("}");
+    fclose(fp);
+}
+
+/* charge_host from the same build, next to argv[0], or from the PATH when
+ * charge_sim was itself found there */
+static const char *sim_default_binary(const char *argv0)
+{
+    static char binary[PATH_MAX];
+    const char *slash = strrchr(argv0, '/');
+
+    if (slash == NULL)
+        return SIM_DEFAULT_BINARY;
+
+    snprintf(binary, sizeof(binary), "%.*s/%s", (int)(slash - argv0), argv0, SIM_DEFAULT_BINARY);
+
+    return binary;
+}
+
+static pid_t sim_spawn(const char *binary, const char *mode, int uevent, int input, int output)
+{
+    char root[PATH_MAX], ufd[16], ifd[16];
+    pid_t pid = fork();
+
+    if (pid != 0)
+        return pid;
+
+    snprintf(root, sizeof(root), "%s", sim_root);
+    snprintf(ufd, sizeof(ufd), "%d", uevent);
+    snprintf(ifd, sizeof(ifd), "%d", input);
+
+    dup2(output, STDOUT_FILENO);
+    execlp(binary, binary, "-r", root, "-f", mode, "-u", ufd, "-i", ifd, (char *)NULL);
+
+    perror(binary);
+    _exit(127);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *binary = sim_default_binary(argv[0]);
+    const char *gif = SIM_DEFAULT_GIF;
+    const char *mode = SIM_DEFAULT_MODE;
+    int seconds = SIM_DEFAULT_TIME;
+    char cache[PATH_MAX];
+    int sock[2], input[2], output[2];
+    int opt, i, status = 0, sampled = 0, killed = 0, exited = 0;
+    double start, end, elapsed, hour;
+    SimStats stats;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "b:g:f:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b': binary = optarg; break;
+            case 'g': gif = optarg; break;
+            case 'f': mode = optarg; break;
+
+            case 't':
+                seconds = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+
+            default:
+                fprintf(stderr, "usage: %s [-b charge binary] [-g file.gif] "
+                        "[-f WxHxBPP] [-t seconds] [script]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind < argc ? sim_load_script(argv[optind]) < 0 : (sim_default_script(seconds), 0))
+        return 1;
+
+    if (mkdtemp(sim_root) == NULL)
+    {
+        perror(sim_root);
+        return 1;
+    }
+
+    for (i = 0; i < (int)(sizeof(sim_files) / sizeof(sim_files[0])); i++)
+    {
+        if (sim_write_file(sim_files[i][0], sim_files[i][1]) < 0)
+            goto FAIL;
+    }
+
+    /* the frame cache partition, charge creates its own directory in it */
+    snprintf(cache, sizeof(cache), "%s/cache", sim_root);
+    mkdir(cache, 0755);
+
+    if (sim_copy_file(gif, SIM_ANIMATION) < 0 ||
+        socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) < 0 ||
+        pipe(input) < 0 || pipe(output) < 0)
+        goto FAIL;
+
+    /* charge ends the session by itself on power off, don't die writing to it */
+    signal(SIGPIPE, SIG_IGN);
+
+    start = now_sec();
+    pid = sim_spawn(binary, mode, sock[1], input[0], output[1]);
+
+    if (pid < 0)
+        goto FAIL;
+
+    close(sock[1]);
+    close(input[0]);
+    close(output[1]);
+
+    for (i = 0; i < sim_count; i++)
+    {
+        sim_wait_until(start + sim_events[i].at, output[0], 0);
+
+        /* charge is gone before the script is through */
+        if (waitpid(pid, &status, WNOHANG) == pid)
+        {
+            exited = 1;
+            break;
+        }
+
+        /* the last event usually ends the session, measure before it */
+        if (i == sim_count - 1)
+            sampled = sim_sample(pid, &stats) == 0;
+
+        sim_apply(&sim_events[i], sock[0], input[1]);
+    }
+
+    end = now_sec();
+
+    /* a script not ending the session leaves charge running */
+    if (!exited && sim_wait_until(end + SIM_EXIT_TIME, output[0], 1) < 0)
+    {
+        kill(pid, SIGTERM);
+        killed = 1;
+    }
+
+    if (!exited)
+        waitpid(pid, &status, 0);
+
+    close(input[1]);
+    close(sock[0]);
+    close(output[0]);
+
+    /* a failed start or a crash measures nothing worth reporting */
+    if (exited && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+    {
+        fprintf(stderr, "sim: %s ended with %s %d after %.1f seconds, %d of %d events\n",
+                binary, WIFEXITED(status) ? "status" : "signal",
+                WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status),
+                end - start, i, sim_count);
+        sim_remove(sim_root);
+        return 1;
+    }
+
+    elapsed = end - start;
+    hour = 3600 / elapsed;
+
+    printf("{\"seconds\": %.1f, \"events\": %d, \"uevents\": %d, \"keys\": %d, "
+           "\"exit\": %d, \"killed\": %d",
+           elapsed, sim_count, sim_uevents, sim_keys,
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1, killed);
+
+    if (sampled)
+    {
+        printf(", \"per_awake_hour\": {\"read_syscalls\": %.0f, \"write_syscalls\": %.0f, "
+               "\"bytes_written\": %.0f, \"wakeups\": %.0f, \"preemptions\": %.0f, "
+               "\"fb_bytes\": %.0f}",
+               stats.syscr * hour, stats.syscw * hour, stats.wchar * hour,
+               stats.voluntary * hour, stats.involuntary * hour, sim_stat("fb_bytes") * hour);
+    }
+
+    sim_print_stats();
+    printf("}\n");
+
+    sim_remove(sim_root);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+
+FAIL:
+    perror("sim");
+    sim_remove(sim_root);
+
+    return 1;
+}
@@ -0,0 +1,180 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef struct _StatsHist StatsHist;
+
+struct _StatsHist
+{
+    char        name[24];
+    uint32_t    count;
+    uint32_t    max;
+    uint64_t    total;
+    uint32_t    buckets[STATS_BUCKETS];     /* [i] below 2^i us, the last the rest */
+};
+
+/* updated from the event loop thread only, apart from the sysfs reads of
+ * the startup thread while the loop is not running yet */
+struct StatsContext
+{
+    uint64_t    start;
+    uint64_t    counters[STATS_COUNTER_MAX];
+    StatsHist   hists[STATS_HIST_MAX];
+    int         hist_count;
+};
+
+static struct StatsContext stats_ctx =
+{
+    .hists = { { "sysfs_read" }, { "sysfs_write" }, { "handler_other" } },
+    .hist_count = STATS_HIST_FIXED,
+};
+
+static const char *stats_names[STATS_COUNTER_MAX] =
+{
+    "timer_ticks",
+    "timer_overruns",
+    "fb_bytes",
+    "uevents",
+    "uevents_ignored",
+    "input_events",
+};
+
+void stats_init()
+{
+    stats_ctx.start = stats_now();
+}
+
+uint64_t stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_count(int counter, uint64_t n)
+{
+    stats_ctx.counters[counter] += n;
+}
+
+void stats_set(int counter, uint64_t value)
+{
+    stats_ctx.counters[counter] = value;
+}
+
+uint64_t stats_get(int counter)
+{
+    return stats_ctx.counters[counter];
+}
+
+int stats_hist(const char *name)
+{
+    int i;
+
+    for (i = 0; i < stats_ctx.hist_count; i++)
+    {
+        if (strcmp(stats_ctx.hists[i].name, name) == 0)
+            return i;
+    }
+
+    if (stats_ctx.hist_count >= STATS_HIST_MAX)
+        return -1;
+
+    snprintf(stats_ctx.hists[i].name, sizeof(stats_ctx.hists[i].name), "%s", name);
+
+    return stats_ctx.hist_count++;
+}
+
+void stats_record(int hist, uint64_t start)
+{
+    uint64_t elapsed = stats_now() - start;
+    StatsHist *h;
+    int bucket = 0;
+
+    if (hist < 0 || hist >= stats_ctx.hist_count)
+        return;
+
+    h = &stats_ctx.hists[hist];
+
+    while (bucket < STATS_BUCKETS - 1 && elapsed >= (1ull << bucket))
+        bucket++;
+
+    h->buckets[bucket]++;
+    h->count++;
+    h->total += elapsed;
+
+    if (elapsed > h->max)
+        h->max = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+}
+
+static void stats_print(FILE *fp)
+{
+    int i, k;
+
+    fprintf(fp, "uptime_ms %llu\n", (unsigned long long)(stats_now() - stats_ctx.start) / 1000);
+
+    for (i = 0; i < STATS_COUNTER_MAX; i++)
+        fprintf(fp, "%s %llu\n", stats_names[i], (unsigned long long)stats_ctx.counters[i]);
+
+    /* name count total_us max_us, then the bucket counts as <limit_us:count */
+    for (i = 0; i < stats_ctx.hist_count; i++)
+    {
+        StatsHist *h = &stats_ctx.hists[i];
+
+        fprintf(fp, "%s %u %llu %u", h->name, h->count, (unsigned long long)h->total, h->max);
+
+        for (k = 0; k < STATS_BUCKETS; k++)
+        {
+            if (h->buckets[k] == 0)
+                continue;
+
+            if (k == STATS_BUCKETS - 1)
+                fprintf(fp, " inf:%u", h->buckets[k]);
+            else
+                fprintf(fp, " <%u:%u", 1u << k, h->buckets[k]);
+        }
+
+        fprintf(fp, "\n");
+    }
+}
+
+int stats_dump(const char *path)
+{
+    char temp[PATH_MAX];
+    FILE *fp;
+
+    snprintf(temp, sizeof(temp), "%s", path);
+
+    if (strrchr(temp, '/'))
+    {
+        *strrchr(temp, '/') = '\0';
+        mkdir(temp, 0755);
+    }
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    fp = fopen(temp, "w");
+
+    if (fp == NULL)
+    {
+        perror(temp);
+        return -1;
+    }
+
+    stats_print(fp);
+
+    if (fclose(fp) != 0 || rename(temp, path) < 0)
+    {
+        perror(path);
+        unlink(temp);
+        return -1;
+    }
+
+    return 0;
+}
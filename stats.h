@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#define STATS_HIST_MAX      24
+#define STATS_BUCKETS       16      /* powers of two of microseconds, the last open */
+
+enum
+{
+    STATS_TIMER_TICKS = 0,          /* timerfd expirations, of all timers */
+    STATS_TIMER_OVERRUNS,           /* expirations beyond the first, handled late */
+    STATS_FB_BYTES,
+    STATS_UEVENTS,
+    STATS_UEVENTS_IGNORED,          /* received but of no power supply */
+    STATS_INPUT_EVENTS,
+    STATS_COUNTER_MAX,
+};
+
+/* the fixed histograms, handlers add their own by name */
+enum
+{
+    STATS_SYSFS_READ = 0,
+    STATS_SYSFS_WRITE,
+    STATS_HANDLER_OTHER,            /* event sources without a name */
+    STATS_HIST_FIXED,
+};
+
+/* uptime in the dump counts from here */
+void stats_init();
+
+/* monotonic microseconds, the start argument of stats_record */
+uint64_t stats_now();
+
+void stats_count(int counter, uint64_t n);
+
+/* for totals kept elsewhere, such as the framebuffer's bytes written */
+void stats_set(int counter, uint64_t value);
+
+uint64_t stats_get(int counter);
+
+/* the histogram called name, added when missing; -1 once the table is full */
+int stats_hist(const char *name);
+
+/* one sample of the time since start, hist -1 is ignored */
+void stats_record(int hist, uint64_t start);
+
+/* counters and histograms as text, written to a temporary file and renamed */
+int stats_dump(const char *path);
+
+#endif/*_STATS_H_*/
@@ -0,0 +1,136 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+typedef struct _TraceEntry TraceEntry;
+
+struct _TraceEntry
+{
+    uint64_t    time;       /* monotonic ns */
+    int         tid;
+    const char *name;       /* NULL ends a span */
+};
+
+struct TraceContext
+{
+    int         enabled;
+    int         marker;     /* -1 records into the ring */
+    int         pid;
+    unsigned    next;       /* bumped atomically, the startup spans come from two threads */
+    TraceEntry  ring[TRACE_RING_MAX];
+};
+
+static struct TraceContext trace_ctx = { .marker = -1 };
+
+int trace_init(const char *root)
+{
+    const char *markers[] = { TRACE_MARKER, TRACE_MARKER_OLD };
+    char path[PATH_MAX];
+    int i;
+
+    trace_ctx.pid = getpid();
+
+    for (i = 0; i < (int)(sizeof(markers) / sizeof(markers[0])) && trace_ctx.marker < 0; i++)
+    {
+        snprintf(path, sizeof(path), "%s%s", root ? root : "", markers[i]);
+        trace_ctx.marker = open(path, O_WRONLY | O_CLOEXEC);
+    }
+
+    trace_ctx.enabled = 1;
+
+    return trace_ctx.marker >= 0 ? 0 : -1;
+}
+
+static void trace_record(const char *name)
+{
+    struct timespec ts;
+    TraceEntry *entry;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    entry = &trace_ctx.ring[__sync_fetch_and_add(&trace_ctx.next, 1) % TRACE_RING_MAX];
+    entry->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    entry->tid = syscall(__NR_gettid);
+    entry->name = name;
+}
+
+void trace_begin(const char *name)
+{
+    char buf[128];
+    int len;
+
+    if (!trace_ctx.enabled)
+        return;
+
+    if (trace_ctx.marker < 0)
+    {
+        trace_record(name);
+        return;
+    }
+
+    /* one write per marker, the kernel keeps it in one piece */
+    len = snprintf(buf, sizeof(buf), "B|%d|%s", trace_ctx.pid, name);
+    write(trace_ctx.marker, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+}
+
+void trace_end()
+{
+    if (!trace_ctx.enabled)
+        return;
+
+    if (trace_ctx.marker < 0)
+        trace_record(NULL);
+    else
+        write(trace_ctx.marker, "E", 1);
+}
+
+int trace_dump(const char *path)
+{
+    char temp[PATH_MAX];
+    unsigned i, next = trace_ctx.next;
+    FILE *fp;
+
+    if (!trace_ctx.enabled || trace_ctx.marker >= 0)
+        return 0;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    fp = fopen(temp, "w");
+
+    if (fp == NULL)
+    {
+        perror(temp);
+        return -1;
+    }
+
+    /* oldest first, "tid seconds B|pid|name" or "tid seconds E" */
+    for (i = next > TRACE_RING_MAX ? next - TRACE_RING_MAX : 0; i < next; i++)
+    {
+        TraceEntry *entry = &trace_ctx.ring[i % TRACE_RING_MAX];
+
+        fprintf(fp, "%d %llu.%06llu ", entry->tid,
+                (unsigned long long)(entry->time / 1000000000),
+                (unsigned long long)(entry->time % 1000000000) / 1000);
+
+        if (entry->name)
+            fprintf(fp, "B|%d|%s\n", trace_ctx.pid, entry->name);
+        else
+            fprintf(fp, "E\n");
+    }
+
+    if (fclose(fp) != 0 || rename(temp, path) < 0)
+    {
+        perror(path);
+        unlink(temp);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#define TRACE_MARKER        "/sys/kernel/tracing/trace_marker"
+#define TRACE_MARKER_OLD    "/sys/kernel/debug/tracing/trace_marker"
+#define TRACE_RING_MAX      512
+
+/* spans go to the ftrace marker below root in the format systrace parses,
+ * so they line up with the scheduler and suspend events of the kernel;
+ * without tracefs they are kept in a ring of TRACE_RING_MAX entries.
+ * until trace_init is called begin and end cost a branch */
+int trace_init(const char *root);
+
+/* name has to stay valid, the ring keeps the pointer */
+void trace_begin(const char *name);
+
+/* closes the innermost span of the calling thread */
+void trace_end();
+
+/* the ring as marker lines with their monotonic time, nothing with tracefs */
+int trace_dump(const char *path);
+
+#endif/*_TRACE_H_*/
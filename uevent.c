@@ -0,0 +1,147 @@
+#include "uevent.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+/* how far the filter looks for the end of the "action@devpath" header */
+#define UEVENT_SCAN_MAX     256
+#define UEVENT_FILTER_MAX   (UEVENT_SCAN_MAX * 4 + 64)
+
+int uevent_parse(char *buf, int len, UEvent *event)
+{
+    char *end = buf + len;
+    char *p, *sep;
+
+    memset(event, 0, sizeof(UEvent));
+
+    if (len <= 0 || buf[len - 1] != '\0')
+        return -1;
+
+    /* the header is "action@devpath", the same values follow as keys */
+    sep = strchr(buf, '@');
+
+    if (sep == NULL)
+        return -1;
+
+    for (p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1)
+    {
+        sep = strchr(p, '=');
+
+        if (sep == NULL || event->count >= UEVENT_PARAMS_MAX)
+            continue;
+
+        *sep = '\0';
+        event->keys[event->count] = p;
+        event->values[event->count] = sep + 1;
+        event->count++;
+
+        /* skip the value, p now points at the key only */
+        p = sep + 1;
+    }
+
+    event->action = uevent_get(event, "ACTION");
+    event->devpath = uevent_get(event, "DEVPATH");
+    event->subsystem = uevent_get(event, "SUBSYSTEM");
+
+    return (event->action && event->devpath) ? 0 : -1;
+}
+
+const char *uevent_get(const UEvent *event, const char *key)
+{
+    int i;
+
+    for (i = 0; i < event->count; i++)
+    {
+        if (strcmp(event->keys[i], key) == 0)
+            return event->values[i];
+    }
+
+    return NULL;
+}
+
+/* compare the packet at X against str including its NUL: accept on match,
+ * fall through to the instruction after the accept otherwise */
+static int uevent_filter_match(struct sock_filter *prog, int n, const char *str)
+{
+    int len = strlen(str) + 1;
+    int start = n, k = 0;
+
+    for (; k + 4 <= len; k += 4)
+    {
+        uint32_t word;
+
+        memcpy(&word, str + k, 4);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, k);
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(word), 0, 0);
+    }
+
+    for (; k + 2 <= len; k += 2)
+    {
+        uint16_t half;
+
+        memcpy(&half, str + k, 2);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, k);
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(half), 0, 0);
+    }
+
+    for (; k < len; k++)
+    {
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, k);
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint8_t)str[k], 0, 0);
+    }
+
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF);
+
+    for (k = start; k < n; k++)
+    {
+        if (BPF_CLASS(prog[k].code) == BPF_JMP)
+            prog[k].jf = n - k - 1;
+    }
+
+    return n;
+}
+
+int uevent_attach_filter(int sock)
+{
+    struct sock_filter prog[UEVENT_FILTER_MAX];
+    struct sock_fprog fprog;
+    int i, n = 0, match;
+
+    /* kernel events start with "action@devpath\0ACTION=action\0
+     * DEVPATH=devpath\0SUBSYSTEM=...", so with H the header length
+     * including its NUL, SUBSYSTEM= sits at 2 * H + 15. Classic BPF has
+     * no loops: the search for the header NUL is unrolled, each hit
+     * loads that offset into X and jumps to the comparisons. */
+    for (i = 0; i < UEVENT_SCAN_MAX; i++)
+    {
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, i);
+        prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 2 * (i + 1) + 15);
+        prog[n++] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, 0);
+    }
+
+    /* header too long to scan, let userspace decide */
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF);
+    match = n;
+
+    for (i = 3; i < match; i += 4)
+        prog[i].k = match - i - 1;
+
+    n = uevent_filter_match(prog, n, "SUBSYSTEM=power_supply");
+    n = uevent_filter_match(prog, n, "SUBSYSTEM=usb");
+    prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+    fprog.len = n;
+    fprog.filter = prog;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+    {
+        perror("SO_ATTACH_FILTER");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef _UEVENT_H_
+#define _UEVENT_H_
+
+#define UEVENT_PARAMS_MAX   48
+
+typedef struct _UEvent UEvent;
+
+struct _UEvent
+{
+    const char *action;
+    const char *devpath;
+    const char *subsystem;
+    int         count;
+    const char *keys[UEVENT_PARAMS_MAX];
+    const char *values[UEVENT_PARAMS_MAX];
+};
+
+/* split a kernel uevent in place, returns -1 when it is malformed */
+int uevent_parse(char *buf, int len, UEvent *event);
+
+const char *uevent_get(const UEvent *event, const char *key);
+
+/* only let power_supply and usb events through to the socket */
+int uevent_attach_filter(int sock);
+
+#endif/*_UEVENT_H_*/